@@ -3,20 +3,71 @@
  * after processing is completed. Multiple files can be simultaneously processed at a time by listing 
  * each filename to be processed (eg. ./edge_detector file1.ppm file2.ppm ... fileN.ppm).
  * Output image files will be created in the directory where edge_detector was invoked.
+ * Alternatively, jobs can be listed in a manifest, one "input output [key=value ...]" job per line,
+ * which gives each job its own output path (eg. ./edge_detector --manifest jobs.txt).
+ * With --cache DIR, results are kept in DIR under a hash of the input pixels and filter settings, and an
+ * image that was already processed is copied from the cache instead of being filtered again.
+ * A job can be limited to a region of interest (roi=x,y,w,h): only the rows of the region (plus a one pixel
+ * border) are read from the file, only the region is filtered, and the output image is the region.
+ * Files flow through a three stage pipeline (read -> filter -> write). Each stage has its own pool of
+ * threads, and the stages are connected by bounded queues so that a fast stage cannot run away from a
+ * slow one (eg. ./edge_detector --readers 2 --filters 1 --writers 2 file1.ppm ... fileN.ppm).
+ * The pipeline can also be kept running as a server that takes jobs over a Unix domain socket
+ * (./edge_detector serve /tmp/edge.sock), and the same binary provides the matching client and a load tester.
  * Author: Cameron Henderson 
  * Date: March 2024
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#include <sys/time.h>
 #include <pthread.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
+#ifndef LAPLACIAN_THREADS
 #define LAPLACIAN_THREADS 4    
+#endif
+
+/* Default number of threads in each pipeline stage, and the default capacity of the queues between them */
+#define READER_THREADS 2
+#define FILTER_THREADS 1
+#define WRITER_THREADS 2
+#define QUEUE_DEPTH 2
+
+/* Rows of the images in memory start on a multiple of this many bytes (a cache line), see struct image */
+#define ROW_ALIGN 64
+
+/* Most rows written with one pwritev, see write_rows */
+#define WRITE_IOVECS 1024
+
+/* Largest request or reply exchanged with the server, in bytes */
+#define SERVER_MAX_MESSAGE 8192
+#ifndef GIT_REV
+#define GIT_REV "unknown"
+#endif
 
 /* Laplacian filter is 3 by 3 */
 #define FILTER_WIDTH 3       
@@ -24,379 +75,5950 @@
 
 #define RGB_COMPONENT_COLOR 255
 
+/* Laplacian coefficients of the center pixel and of each of its 8 neighbours */
+#define LAPLACIAN_CENTER 8
+#define LAPLACIAN_NEIGHBOUR (-1)
+
+/* Bounds of a Laplacian sum of 8-bit samples: every sample with a positive coefficient at RGB_COMPONENT_COLOR 
+ and the others at 0, and the other way round. Any partial sum lies between them too. */
+#define POSITIVE_PART(c) ((c) > 0 ? (c) : 0)
+#define NEGATIVE_PART(c) ((c) < 0 ? (c) : 0)
+#define LAPLACIAN_SUM_MAX (RGB_COMPONENT_COLOR * (POSITIVE_PART(LAPLACIAN_CENTER) + 8 * POSITIVE_PART(LAPLACIAN_NEIGHBOUR)))
+#define LAPLACIAN_SUM_MIN (RGB_COMPONENT_COLOR * (NEGATIVE_PART(LAPLACIAN_CENTER) + 8 * NEGATIVE_PART(LAPLACIAN_NEIGHBOUR)))
+
+/* Accumulate the Laplacian in 16-bit lanes, twice as many per vector as int, whenever its sums fit in int16_t.
+ Can be turned off with -D LAPLACIAN_ACCUM16=0. */
+#ifndef LAPLACIAN_ACCUM16
+#define LAPLACIAN_ACCUM16 (LAPLACIAN_SUM_MAX <= INT16_MAX && LAPLACIAN_SUM_MIN >= INT16_MIN)
+#endif
+_Static_assert(!LAPLACIAN_ACCUM16 || (LAPLACIAN_SUM_MAX <= INT16_MAX && LAPLACIAN_SUM_MIN >= INT16_MIN),
+               "the Laplacian sums overflow int16_t, build with -D LAPLACIAN_ACCUM16=0");
+
 typedef struct {
       unsigned char r, g, b;
 } PPMPixel;
 
+/* An image in memory: h rows of w pixels. Each row starts stride bytes after the previous one, stride being
+ w * sizeof(PPMPixel) rounded up to a multiple of ROW_ALIGN, and the pixels are ROW_ALIGN aligned, so every row
+ starts on its own cache line: loads from the start of a row are aligned, and two band threads never write the 
+ same line. The padding at the end of the rows is never read or written out (the rows of a PPM file are packed, 
+ see read_pixels and write_rows).
+ */
+struct image {
+    PPMPixel *pixels;
+    unsigned long w;
+    unsigned long h;
+    size_t stride;           //bytes from the start of a row to the start of the next one
+    void *buffer;            //allocation holding pixels, freed by image_free (NULL when img does not own it)
+    int bits;                //each row starts with its pixels packed 1 bit each (PBM P4), see threshold_row
+};
+
+/* How the filter sees the pixels past the edges of the image */
+enum border_mode {
+    BORDER_WRAP,                 //the opposite edge (the image is a torus)
+    BORDER_CLAMP,                //the nearest edge pixel
+    BORDER_MIRROR,               //the image reflected about its edge pixels
+    BORDER_ZERO,                 //black
+    NUM_BORDER_MODES
+};
+
+static const char *border_mode_names[NUM_BORDER_MODES] = {"wrap", "clamp", "mirror", "zero"};
+
+/* Largest width and height of a convolution kernel */
+#define KERNEL_MAX_SIZE 31
+
+/* An integer convolution kernel. Each result component is the sum of the coefficients times the components under 
+ them, divided by divisor (rounding toward zero), then clamped to 0..RGB_COMPONENT_COLOR. 
+ The sum of the absolute values of the coefficients is at most KERNEL_MAX_WEIGHT, so that no sum overflows an int.
+ */
+struct kernel {
+    int w, h;                    //odd, at most KERNEL_MAX_SIZE
+    int divisor;                 //never 0
+    int coeffs[KERNEL_MAX_SIZE * KERNEL_MAX_SIZE];   //h rows of w coefficients
+};
+
+/* A kernel of rank 1 or 2 split into terms computed in two passes (see split_kernel): scale times the kernel is the
+ sum over the terms t of col[t] (a column, k->h coefficients) times row[t] (a row, k->w coefficients).
+ Sobel x is the column -1 -2 -1 times the row 1 0 -1, the 3 by 3 Laplacian is the column -1 0 -1 times the row 1 1 1
+ plus the column 0 -1 0 times the row 1 -8 1.
+ The sums of the horizontal passes fit in int16_t, and the sums of the terms stay below PASSES_SUM_LIMIT.
+ */
+struct kernel_passes {
+    int terms;                   //1 or 2
+    int scale;                   //positive, divides the sum of the terms exactly
+    int sum_max;                 //largest absolute sum of the terms over 8-bit samples
+    int row[2][KERNEL_MAX_SIZE];
+    int col[2][KERNEL_MAX_SIZE];
+};
+
+/* 2^24: below it float division truncates to the exact quotient, see divide_i32x4 */
+#define PASSES_SUM_LIMIT (1 << 24)
+
+#define KERNEL_MAX_WEIGHT (INT32_MAX / RGB_COMPONENT_COLOR)
+
+/* The default kernel: the 3 by 3 Laplacian */
+#define LAPLACIAN8_KERNEL { 3, 3, 1, { LAPLACIAN_NEIGHBOUR, LAPLACIAN_NEIGHBOUR, LAPLACIAN_NEIGHBOUR, \
+                                       LAPLACIAN_NEIGHBOUR, LAPLACIAN_CENTER,    LAPLACIAN_NEIGHBOUR, \
+                                       LAPLACIAN_NEIGHBOUR, LAPLACIAN_NEIGHBOUR, LAPLACIAN_NEIGHBOUR } }
+
+/* Filter the pixels x0 to x1 - 1 of a row with kernel k into out (the result pixel of x0): rows are the k->h input 
+ rows centered on it, and the kernel never leaves them. See convolve_row. 
+ */
+typedef void (*kernel_row_fn)(const struct kernel *k, const PPMPixel *const *rows, unsigned long x0, unsigned long x1, 
+                              PPMPixel *out);
+
 struct parameter {
-    PPMPixel *image;         //original image pixel data
-    PPMPixel *result;        //filtered image pixel data
-    unsigned long int w;     //width of image
-    unsigned long int h;     //height of image
+    const struct image *image;   //original image
+    struct image *result;        //filtered image
+    unsigned long int halo;  //width of the border of image that is only input (the kernel radius for a region of interest, else 0)
+    enum border_mode border; //pixels past the edges of the image, when halo is 0
+    const struct kernel *kernel; //convolution kernel
+    kernel_row_fn row_fn;    //interior row computation of kernel, see find_row_fn
+    const struct kernel_passes *passes; //kernel split in terms, see compute_passes_threadfn
+    const struct fft_filter *fft;       //kernel spectrum and tiles, see compute_fft_threadfn
+    int canny_low, canny_high;   //Canny thresholds, see compute_canny_threadfn
+    int canny_seeded;            //pixels of the first or last row of the band became pending, see canny_merge_bands
+    int threshold;               //pack each result row into bits once it is computed, see band_row_done (0: do not)
+    PPMPixel *history;       //in-place filtering: kernel->h rows of image->stride bytes, see compute_convolution_inplace_threadfn
     unsigned long int start; //starting point of work
     unsigned long int size;  //equal share of work (almost equal if odd)
+    void *(*band_fn)(void *);    //band computation, see filter_variants
+    long image_id;               //job id, for tracing
+    int index;                   //band index, for tracing
+    struct band_batch *batch;    //batch this band belongs to
+    struct parameter *next;      //next band in the band pool queue
+};
+
+/* The bands of one image handed to the band pool. The submitter waits until remaining drops to zero. */
+struct band_batch {
+    unsigned long remaining;     //bands not finished yet, protected by the band pool mutex
+    pthread_cond_t done;
+};
+
+/* Long-lived threads that compute the bands of every image, so that no thread is created per image.
+ */
+struct band_pool {
+    struct parameter *head;
+    struct parameter *tail;
+    int shutdown;
+    int num_threads;
+    pthread_t *threads;
+    pthread_mutex_t mtx;
+    pthread_cond_t work;
+};
+
+/* A rectangle of an image, in pixels */
+struct region {
+    unsigned long int x;
+    unsigned long int y;
+    unsigned long int w;
+    unsigned long int h;
+};
+
+/* Options that can be set per job, either on the command line or in a request to the server. */
+struct job_options {
+    int threads;                 //number of bands (threads) the image is split into
+    int variant;                 //index in filter_variants of the band computation to use
+    struct kernel kernel;        //convolution kernel, the Laplacian by default
+    enum border_mode border;     //pixels past the edges of the image
+    int has_roi;                 //only filter the region of interest roi
+    struct region roi;
+    int inplace;                 //write the result over the input image instead of into a second buffer
+    int canny;                   //Canny edge detection instead of the kernel, see compute_canny_threadfn
+    int canny_low, canny_high;   //its thresholds
+    int threshold;               //write a 1-bit PBM of the pixels with a component from threshold (1 to 255), 0: off
 };
 
 
 struct file_name_args {
     char *input_file_name;      //e.g., file1.ppm 
-    char output_file_name[64];  //will take the form laplaciani.ppm, e.g., laplacian1.ppm
+    char *output_file_name;     //e.g., laplacian1.ppm, or the output path given in the manifest
+};
+
+/* Time spent by an image in each stage of the pipeline, in seconds (CLOCK_MONOTONIC) */
+struct stage_times {
+    double read;               //reading and parsing the input, and the cache lookup
+    double filter;             //apply_filters
+    double write;              //writing the output, or copying it from the cache
+    double queue_wait;         //waiting in the queues between the stages
+};
+
+/* Live and peak bytes of image buffers, see mem_malloc */
+struct mem_account {
+    long long live;              //bytes allocated and not freed yet
+    long long peak;              //highest value of live
+};
+
+/* An image travelling through the pipeline. The reader fills in image, w and h, 
+ * the filter fills in result, each stage adds its time to times, and the writer frees everything. 
+ */
+struct image_job {
+    struct file_name_args names;
+    struct job_options opts;
+    int input_fd;              //when not -1, read the image from this descriptor instead of input_file_name
+    int status;                //0 if the job succeeded, -1 if any stage failed
+    struct job_waiter *waiter; //when set, signalled when the job is finished instead of freeing it
+    struct image image;        //original image, no pixels until read
+    struct image result;       //filtered image, no pixels until filtered
+    unsigned long int w;       //width of image (of the result once filtered)
+    unsigned long int h;       //height of image
+    struct stage_times times;
+    double submit_time;        //when the job was created, for its end to end latency
+    double enqueue_time;       //when the job entered the queue it is in
+    unsigned long long input_bytes;   //pixel bytes read
+    uint64_t cache_key;        //hash of the input pixels and filter settings, when the cache is enabled
+    int cache_hit;             //the result is copied from the cache instead of being filtered
+    int cache_fd;              //on a cache hit, the entry opened by the lookup, closed by the writer
+    int out_of_core;           //too large for memory_cap: the filter stage reads, filters and writes it in strips
+    long id;                   //number of the job in submission order, for tracing
+    struct mem_account mem;    //image buffers of the job
+    struct image_job *next;    //next job in the queue
+};
+
+/* Lets a server connection wait for the job it submitted to come out of the pipeline. */
+struct job_waiter {
+    int finished;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+};
+
+/* Bounded FIFO of jobs between two pipeline stages. Pushing to a full queue blocks until a consumer
+ * makes room, which is what keeps a fast stage from buffering an unbounded number of images.
+ * The queue is closed once every producer has called job_queue_close; after that, job_queue_pop 
+ * drains the remaining jobs and then returns NULL.
+ */
+struct job_queue {
+    struct image_job *head;
+    struct image_job *tail;
+    unsigned long count;       //number of jobs in the queue
+    unsigned long capacity;    //maximum number of jobs in the queue
+    int producers;             //producers that have not closed the queue yet
+    pthread_mutex_t mtx;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+/* The stages of the pipeline and the queues connecting them.
+ * read_q (fed by main) -> readers -> filter_q -> filters -> write_q -> writers
+ */
+struct pipeline {
+    struct job_queue read_q;
+    struct job_queue filter_q;
+    struct job_queue write_q;
+    int readers;
+    int filters;
+    int writers;
+    pthread_t *threads;        //readers + filters + writers threads
 };
 
 
-/*The total_elapsed_time is the total time taken by all threads 
-to compute the edge detection of all input images .
+/*The total_times are the total times taken by all threads in each stage for all input images,
+total_times.filter being the total time to compute the edge detection of all input images.
 */
-double total_elapsed_time = 0; 
-pthread_mutex_t mtx_etime; // mutex to lock total_elapsed_time
+struct stage_times total_times; 
+unsigned long total_images = 0;   // number of images written
+double total_mpix = 0;            // megapixels written
+pthread_mutex_t mtx_etime; // mutex to lock total_times and total_images
 
+/* Human-readable progress and summary lines go to report_out, which is stderr when the metrics go to stdout */
+FILE *report_out;
 
-/*This is the thread function. It will compute the new values for the region of image specified in params (start to start+size) 
-	using convolution. For each pixel in the input image, the filter is conceptually placed on top ofthe image with its origin
-    lying on that pixel. The  values  of  each  input  image  pixel  under  the  mask  are  multiplied  by the corresponding 
-	filter values. Truncate values smaller than zero to zero and larger than 255 to 255. The results are summed together to 
-    yield a single output value that is placed in the output image at the location of the pixel being processed on the input.
- 
+/* Machine-readable metrics (--metrics=json|csv): one record per image, then a summary of the run */
+enum metrics_format { METRICS_NONE, METRICS_JSON, METRICS_CSV };
+enum metrics_format metrics_format = METRICS_NONE;
+FILE *metrics_out = NULL;
+double *job_latencies = NULL;        // end to end latency of each finished job, for the percentiles
+unsigned long num_latencies = 0;
+unsigned long latencies_capacity = 0;
+unsigned long failed_images = 0;    // jobs that left the pipeline with an error, see finish_job
+pthread_mutex_t mtx_metrics; // mutex to lock metrics_out, the latencies and failed_images
+
+/* Options of jobs that do not set their own, can be changed with --threads and --option */
+struct job_options default_options = { .threads = LAPLACIAN_THREADS, .kernel = LAPLACIAN8_KERNEL };
+
+struct band_pool band_pool;
+
+/* Streaming state of the XXH64 hash, see xxh64_update */
+struct xxh64_state {
+    uint64_t total_len;
+    uint64_t v[4];
+    unsigned char mem[32];     //input not yet consumed, less than a 32-byte stripe
+    unsigned int memsize;
+    uint64_t seed;
+};
+
+/* Result cache directory (NULL when the cache is disabled) and its counters */
+const char *cache_dir = NULL;
+unsigned long cache_hits = 0;
+unsigned long cache_misses = 0;
+unsigned long long cache_bytes_saved = 0;   //size of the outputs copied from the cache
+pthread_mutex_t mtx_cache; // mutex to lock the cache counters
+
+/* With --memory-cap, images whose buffers would not fit in memory_cap bytes are filtered in strips (see filter_strips) */
+unsigned long long memory_cap = 0;
+
+
+/* Hardware performance counters (--counters). Every thread opens its own counters the first time it measures
+ something, counting only that thread in user space, and adds the counts of each measured region (read_image,
+ a band of apply_filters, write_image) to its per stage totals. The totals of a thread are added to perf_totals
+ when it exits, so the summary has the sums per stage over all threads.
+ If the counters cannot be opened (no PMU in a VM, perf_event_paranoid, seccomp), they are disabled and the run
+ goes on without them.
  */
-void *compute_laplacian_threadfn(void *params)
+enum perf_event_index { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_NUM_EVENTS };
+enum perf_stage { PERF_READ, PERF_FILTER, PERF_WRITE, PERF_NUM_STAGES };
+
+static const struct {
+    const char *name;
+    uint64_t config;
+} perf_events[PERF_NUM_EVENTS] = {
+	{"cycles",          PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions",    PERF_COUNT_HW_INSTRUCTIONS},
+	{"LLC misses",      PERF_COUNT_HW_CACHE_MISSES},
+	{"branch misses",   PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static const char *perf_stage_names[PERF_NUM_STAGES] = {"read", "filter", "write"};
+
+/* Counter values, or counts accumulated over a stage */
+struct perf_counts {
+    uint64_t value[PERF_NUM_EVENTS];
+    unsigned long long pixels;       //pixels processed while counting
+    unsigned long threads;           //threads that contributed (totals only)
+};
+
+int perf_enabled = 0;                                //--counters was given and the counters work
+struct perf_counts perf_totals[PERF_NUM_STAGES];     //sums over all threads
+pthread_mutex_t mtx_perf = PTHREAD_MUTEX_INITIALIZER; // mutex to lock perf_totals and perf_enabled
+
+/* Counters of the calling thread */
+static __thread struct {
+    int opened;                      //0: not yet, 1: open, -1: unavailable
+    int fd[PERF_NUM_EVENTS];         //-1 for an event this CPU does not have
+    struct perf_counts stage[PERF_NUM_STAGES];
+} perf_thread;
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags)
 {
-    struct parameter* p = (struct parameter*) params;
-	PPMPixel *image = p->image;
-	PPMPixel *result = p->result;
-	unsigned long w = p->w;
-	unsigned long h = p->h;
-	unsigned long start = p->start;
-	unsigned long size = p->size;
+	return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
 
-    int laplacian[FILTER_WIDTH][FILTER_HEIGHT] =
-    {
-        {-1, -1, -1},
-        {-1,  8, -1},
-        {-1, -1, -1}
-    };
+/* Open the counters of the calling thread. When cycles cannot be counted the counters are disabled for 
+ every thread with a single warning. Return: 0 if the thread has counters, -1 otherwise.
+ */
+static int perf_thread_open(void)
+{
+	if (perf_thread.opened) return perf_thread.opened > 0 ? 0 : -1;
+	perf_thread.opened = -1;
+	for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof attr);
+		attr.size = sizeof attr;
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = perf_events[e].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		perf_thread.fd[e] = perf_event_open(&attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if (perf_thread.fd[e] < 0 && e == PERF_CYCLES) {
+			pthread_mutex_lock(&mtx_perf);
+			if (perf_enabled) {
+				fprintf(stderr, "hardware counters unavailable (%s), continuing without them\n", strerror(errno));
+				perf_enabled = 0;
+			}
+			pthread_mutex_unlock(&mtx_perf);
+			return -1;
+		}
+	}
+	perf_thread.opened = 1;
+	return 0;
+}
 
-    int red, green, blue;   
-	unsigned long x_coordinate;
-	unsigned long y_coordinate;
-	for (unsigned long img_y = start; img_y < start + size; img_y++) {
-		for (unsigned long img_x  = 0; img_x < w; img_x++) {
-			red = 0;
-			green = 0;
-			blue = 0;
-			for (int filter_x = 0; filter_x < FILTER_WIDTH; filter_x++) {
-				for (int filter_y = 0; filter_y < FILTER_HEIGHT; filter_y++) {
-					x_coordinate = (img_x - FILTER_WIDTH / 2 + filter_x + w) % w;
-					y_coordinate = (img_y - FILTER_HEIGHT / 2 + filter_y + h) % h;
-					red += image[y_coordinate * w + x_coordinate].r * laplacian[filter_y][filter_x];
-					green += image[y_coordinate * w + x_coordinate].g * laplacian[filter_y][filter_x];
-					blue += image[y_coordinate * w + x_coordinate].b * laplacian[filter_y][filter_x];
-				}
+/* Read the current counter values of the calling thread into counts.
+ Return: 0 on success, -1 if the counters are disabled.
+ */
+int perf_begin(struct perf_counts *counts)
+{
+	if (!perf_enabled || perf_thread_open()) return -1;
+	for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+		uint64_t value = 0;
+		if (perf_thread.fd[e] >= 0 && read(perf_thread.fd[e], &value, sizeof value) != sizeof value) value = 0;
+		counts->value[e] = value;
+	}
+	return 0;
+}
+
+/* Add the counts since perf_begin(start) and the pixels of the region to the calling thread's stage totals. */
+void perf_end(const struct perf_counts *start, enum perf_stage stage, unsigned long long pixels)
+{
+	struct perf_counts now;
+	if (perf_begin(&now)) return;
+	struct perf_counts *total = &perf_thread.stage[stage];
+	for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+		total->value[e] += now.value[e] - start->value[e];
+	}
+	total->pixels += pixels;
+}
+
+/* Add the calling thread's totals to perf_totals and close its counters. Called by each thread before it exits. */
+void perf_thread_close(void)
+{
+	if (perf_thread.opened <= 0) return;
+	pthread_mutex_lock(&mtx_perf);
+	for (int s = 0; s < PERF_NUM_STAGES; s++) {
+		struct perf_counts *c = &perf_thread.stage[s];
+		if (c->pixels == 0) continue;
+		for (int e = 0; e < PERF_NUM_EVENTS; e++) perf_totals[s].value[e] += c->value[e];
+		perf_totals[s].pixels += c->pixels;
+		perf_totals[s].threads++;
+	}
+	pthread_mutex_unlock(&mtx_perf);
+	for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+		if (perf_thread.fd[e] >= 0) close(perf_thread.fd[e]);
+	}
+	memset(&perf_thread, 0, sizeof perf_thread);
+}
+
+/* Print the counts of each stage, with the IPC and the misses per pixel that tell a memory-bound stage 
+ (many LLC misses per pixel, low IPC) from a compute-bound one.
+ */
+void perf_print_summary(FILE *out)
+{
+	if (!perf_enabled) return;
+	for (int s = 0; s < PERF_NUM_STAGES; s++) {
+		struct perf_counts *c = &perf_totals[s];
+		if (c->pixels == 0) continue;
+		const uint64_t *v = c->value;
+		fprintf(out, "Counters %s (%lu threads): cycles %llu, instructions %llu, IPC %.2f, "
+		        "LLC misses %llu (%.4f/pixel), branch misses %llu (%.4f/pixel)\n",
+		        perf_stage_names[s], c->threads, (unsigned long long)v[PERF_CYCLES], (unsigned long long)v[PERF_INSTRUCTIONS],
+		        v[PERF_CYCLES] ? (double)v[PERF_INSTRUCTIONS] / v[PERF_CYCLES] : 0,
+		        (unsigned long long)v[PERF_LLC_MISSES], (double)v[PERF_LLC_MISSES] / c->pixels,
+		        (unsigned long long)v[PERF_BRANCH_MISSES], (double)v[PERF_BRANCH_MISSES] / c->pixels);
+	}
+}
+
+/* Current time in seconds on the monotonic clock, for measuring intervals. */
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile p (0 to 100) of the n sorted values. */
+double percentile(const double *sorted, long n, double p)
+{
+	double exact = p / 100 * n;
+	long rank = (long)exact;
+	if (rank < exact || rank < 1) rank++;
+	if (rank > n) rank = n;
+	return sorted[rank - 1];
+}
+
+/* Memory accounting of the image buffers (inputs, results and band parameters), which are nearly all the memory
+ a run uses. Every buffer is counted in the run totals, and in the totals of the job the calling thread is working on
+ (mem_owner, set by the stage threads), so that the summary and the metrics have the live and peak bytes of each
+ image and of the whole run. Sizes are the usable sizes of the malloc blocks.
+ */
+struct mem_account mem_run;                  //all image buffers of the run
+static __thread struct mem_account *mem_owner;  //job of the calling thread, or NULL
+
+static void mem_account_add(struct mem_account *account, long long bytes)
+{
+	long long live = __atomic_add_fetch(&account->live, bytes, __ATOMIC_RELAXED);
+	long long peak = __atomic_load_n(&account->peak, __ATOMIC_RELAXED);
+	while (live > peak && !__atomic_compare_exchange_n(&account->peak, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Huge page backed image buffers (--huge-pages thp|hugetlb). The filter walks three rows of a multi-megabyte image
+ at once, so with 4 KiB pages most of its accesses miss the TLB. In these modes a buffer of at least HUGE_PAGE_SIZE 
+ bytes gets a mapping of its own, rounded up to and aligned on 2 MiB: from the hugetlbfs pool with MAP_HUGETLB 
+ (hugetlb mode, when huge pages have been reserved), or else anonymous memory marked MADV_HUGEPAGE for transparent 
+ huge pages. When neither can be mapped the buffer comes from malloc as usual.
+ A THP mapping is preceded by an inaccessible guard page so that the kernel never merges it with its neighbours,
+ and its entry in /proc/self/smaps tells how much of it the kernel actually backed with huge pages (the coverage
+ in the summary). That is measured when the mapping is unmapped, or at the summary for the mappings still in use.
+ */
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define GUARD_PAGE_SIZE 4096UL
+
+enum huge_page_mode { HUGE_PAGES_OFF, HUGE_PAGES_THP, HUGE_PAGES_HUGETLB, NUM_HUGE_PAGE_MODES };
+static const char *huge_page_mode_names[NUM_HUGE_PAGE_MODES] = { "off", "thp", "hugetlb" };
+
+struct huge_buffer {
+    void *ptr;                   //start of the buffer, 2 MiB aligned
+    size_t size;                 //size of the buffer, a multiple of 2 MiB
+    int hugetlb;                 //mapped with MAP_HUGETLB, otherwise there is a guard page before ptr
+    int measured;                //its coverage has been added to the totals
+    struct huge_buffer *next;
+};
+
+enum huge_page_mode huge_pages = HUGE_PAGES_OFF;
+static struct huge_buffer *huge_buffers;        //mapped buffers, in use or in the pool
+static unsigned long huge_maps[2];              //buffers mapped with THP, with MAP_HUGETLB
+static unsigned long huge_fallbacks;            //buffers that came from malloc because mapping failed
+static unsigned long long huge_measured_bytes;  //bytes of the measured buffers
+static unsigned long long huge_backed_bytes;    //of which backed by huge pages
+static pthread_mutex_t mtx_huge = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return: the bytes of the mapping at ptr that are backed by huge pages, from /proc/self/smaps. */
+static unsigned long long huge_backed(const void *ptr)
+{
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	if (!smaps) return 0;
+	char line[512];
+	unsigned long long kb = 0;
+	int in_mapping = 0;
+	while (fgets(line, sizeof line, smaps)) {
+		unsigned long start, end, value;
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			if (in_mapping) break;
+			in_mapping = start == (uintptr_t)ptr;
+		} else if (in_mapping && (sscanf(line, "AnonHugePages: %lu kB", &value) == 1 || 
+		           sscanf(line, "Private_Hugetlb: %lu kB", &value) == 1 || sscanf(line, "Shared_Hugetlb: %lu kB", &value) == 1)) {
+			kb += value;
+		}
+	}
+	fclose(smaps);
+	return kb * 1024;
+}
+
+/* Add the coverage of hb to the totals. Called with mtx_huge locked. */
+static void huge_measure(struct huge_buffer *hb)
+{
+	if (hb->measured) return;
+	hb->measured = 1;
+	huge_measured_bytes += hb->size;
+	huge_backed_bytes += huge_backed(hb->ptr);
+}
+
+/* Map a huge page backed buffer of at least size bytes.
+ Return: the buffer, or NULL if it could not be mapped.
+ */
+static void *huge_alloc(size_t size)
+{
+	size_t length = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	struct huge_buffer *hb = malloc(sizeof *hb);
+	if (!hb) return NULL;
+	void *ptr = MAP_FAILED;
+	if (huge_pages == HUGE_PAGES_HUGETLB) {
+		ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	hb->hugetlb = ptr != MAP_FAILED;
+	if (ptr == MAP_FAILED) {
+		// one more huge page than needed, to find a 2 MiB boundary with room for the guard page before it
+		size_t reserved = length + HUGE_PAGE_SIZE;
+		unsigned char *base = mmap(NULL, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base != MAP_FAILED) {
+			unsigned char *aligned = (unsigned char*)(((uintptr_t)base + GUARD_PAGE_SIZE + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+			unsigned char *guard = aligned - GUARD_PAGE_SIZE;
+			if (guard > base) munmap(base, guard - base);
+			if (base + reserved > aligned + length) munmap(aligned + length, base + reserved - (aligned + length));
+			mprotect(guard, GUARD_PAGE_SIZE, PROT_NONE);
+			madvise(aligned, length, MADV_HUGEPAGE);  // fails without THP support, leaving normal pages
+			ptr = aligned;
+		}
+	}
+	if (ptr == MAP_FAILED) {
+		free(hb);
+		return NULL;
+	}
+	hb->ptr = ptr;
+	hb->size = length;
+	hb->measured = 0;
+	pthread_mutex_lock(&mtx_huge);
+	hb->next = huge_buffers;
+	huge_buffers = hb;
+	huge_maps[hb->hugetlb]++;
+	pthread_mutex_unlock(&mtx_huge);
+	return ptr;
+}
+
+/* Return: the entry of the huge page backed buffer at ptr, or NULL if ptr comes from malloc. Called with mtx_huge locked. */
+static struct huge_buffer **huge_find(const void *ptr)
+{
+	if ((uintptr_t)ptr & (HUGE_PAGE_SIZE - 1)) return NULL;
+	for (struct huge_buffer **hb = &huge_buffers; *hb; hb = &(*hb)->next) {
+		if ((*hb)->ptr == ptr) return hb;
+	}
+	return NULL;
+}
+
+/* Allocate an image buffer of size bytes, ROW_ALIGN aligned, huge page backed when --huge-pages is on and it is large enough. */
+static void *buffer_alloc(size_t size)
+{
+	if (huge_pages != HUGE_PAGES_OFF && size >= HUGE_PAGE_SIZE) {
+		void *ptr = huge_alloc(size);
+		if (ptr) return ptr;
+		__atomic_add_fetch(&huge_fallbacks, 1, __ATOMIC_RELAXED);
+	}
+	void *ptr;
+	return posix_memalign(&ptr, ROW_ALIGN, size) ? NULL : ptr;
+}
+
+/* Return: the usable size of a buffer from buffer_alloc. */
+static size_t buffer_size(void *ptr)
+{
+	if (huge_pages != HUGE_PAGES_OFF) {
+		pthread_mutex_lock(&mtx_huge);
+		struct huge_buffer **hb = huge_find(ptr);
+		size_t size = hb ? (*hb)->size : 0;
+		pthread_mutex_unlock(&mtx_huge);
+		if (hb) return size;
+	}
+	return malloc_usable_size(ptr);
+}
+
+static void buffer_free(void *ptr)
+{
+	if (huge_pages != HUGE_PAGES_OFF) {
+		pthread_mutex_lock(&mtx_huge);
+		struct huge_buffer **entry = huge_find(ptr);
+		struct huge_buffer *hb = entry ? *entry : NULL;
+		if (hb) {
+			huge_measure(hb);
+			*entry = hb->next;
+		}
+		pthread_mutex_unlock(&mtx_huge);
+		if (hb) {
+			if (hb->hugetlb) {
+				munmap(hb->ptr, hb->size);
+			} else {
+				munmap((unsigned char*)hb->ptr - GUARD_PAGE_SIZE, hb->size + GUARD_PAGE_SIZE);
 			}
-			// restrict colors to values between 0 and RGB_COMPONENT_COLOR
-			red = red < 0 ? 0 : red;
-			red = red > RGB_COMPONENT_COLOR ? RGB_COMPONENT_COLOR : red;		
-			green = green < 0 ? 0: green;
-			green = green > RGB_COMPONENT_COLOR ? RGB_COMPONENT_COLOR : green;		
-			blue = blue < 0 ? 0 : blue;
-			blue = blue > RGB_COMPONENT_COLOR ? RGB_COMPONENT_COLOR : blue;			
+			free(hb);
+			return;
+		}
+	}
+	free(ptr);
+}
+
+/* Print the huge page coverage of the run: the share of the bytes of the huge page buffers that the kernel 
+ backed with huge pages. The buffers still mapped are measured now.
+ */
+static void huge_print_summary(FILE *out)
+{
+	if (huge_pages == HUGE_PAGES_OFF) return;
+	pthread_mutex_lock(&mtx_huge);
+	for (struct huge_buffer *hb = huge_buffers; hb; hb = hb->next) {
+		huge_measure(hb);
+	}
+	fprintf(out, "Huge pages (%s): %lu buffers mapped (%lu hugetlb, %lu THP), %lu fell back to malloc, "
+	        "%llu of %llu bytes backed by huge pages (%.1f%%)\n", huge_page_mode_names[huge_pages],
+	        huge_maps[0] + huge_maps[1], huge_maps[1], huge_maps[0], huge_fallbacks, huge_backed_bytes, huge_measured_bytes,
+	        huge_measured_bytes ? 100.0 * huge_backed_bytes / huge_measured_bytes : 0.0);
+	pthread_mutex_unlock(&mtx_huge);
+}
+
+static void mem_count(void *ptr, long long sign)
+{
+	if (!ptr) return;
+	long long bytes = sign * (long long)buffer_size(ptr);
+	mem_account_add(&mem_run, bytes);
+	if (mem_owner) mem_account_add(mem_owner, bytes);
+}
+
+/* Buffer pool of the image buffers. Without it every image costs a fresh mmap of its multi-megabyte buffers
+ (glibc does not keep blocks that large), a page fault and a zeroing of every page, and a munmap at the end.
+ A request of more than POOL_MIN_BYTES is rounded up to a size class, four per power of two, and a freed buffer
+ goes to the free list of the largest class it can hold, where the next request of that class takes it, from any
+ thread. At most pool_limit bytes are kept in the lists (--pool-limit, 0 disables the pool).
+ */
+#define POOL_MIN_BYTES (64 * 1024)
+#define POOL_CLASSES 180                    //up to 7 << (44 + 14) bytes
+
+struct pool_buffer {
+    struct pool_buffer *next;
+};
+
+unsigned long long pool_limit = 1ULL << 30;
+static struct pool_buffer *pool_lists[POOL_CLASSES];
+static unsigned long long pool_bytes;       //bytes in the free lists
+static unsigned long pool_hits;
+static unsigned long pool_misses;
+static pthread_mutex_t mtx_pool = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return: the size of class c, (4 + c % 4) << (c / 4 + 14) bytes */
+static size_t pool_class_size(int c)
+{
+	return (size_t)(4 + c % 4) << (c / 4 + 14);
+}
+
+/* Return: the smallest class of at least size bytes (size > POOL_MIN_BYTES). */
+static int pool_class(size_t size)
+{
+	int k = 63 - __builtin_clzll(size - 1);     // 2^k < size <= 2^(k+1), k >= 16
+	int quarter = ((size - 1) >> (k - 2)) & 3;  // size - 1 is in [(4 + quarter) << (k - 2), (5 + quarter) << (k - 2))
+	return (k - 16) * 4 + quarter + 1;
+}
+
+static void *pool_malloc(size_t size)
+{
+	if (!pool_limit || size <= POOL_MIN_BYTES || pool_class(size) >= POOL_CLASSES) {
+		return buffer_alloc(size);
+	}
+	int c = pool_class(size);
+	pthread_mutex_lock(&mtx_pool);
+	struct pool_buffer *buffer = pool_lists[c];
+	if (buffer) {
+		pool_lists[c] = buffer->next;
+		pool_bytes -= buffer_size(buffer);
+		pool_hits++;
+	} else {
+		pool_misses++;
+	}
+	pthread_mutex_unlock(&mtx_pool);
+	return buffer ? (void*)buffer : buffer_alloc(pool_class_size(c));
+}
+
+static void pool_free(void *ptr)
+{
+	size_t usable = ptr ? buffer_size(ptr) : 0;
+	if (!pool_limit || usable < POOL_MIN_BYTES) {
+		buffer_free(ptr);
+		return;
+	}
+	int c = pool_class(usable + 1) - 1;  // the largest class the buffer holds
+	if (c >= POOL_CLASSES) {
+		buffer_free(ptr);
+		return;
+	}
+	struct pool_buffer *buffer = (struct pool_buffer*) ptr;
+	pthread_mutex_lock(&mtx_pool);
+	int keep = pool_bytes + usable <= pool_limit;
+	if (keep) {
+		buffer->next = pool_lists[c];
+		pool_lists[c] = buffer;
+		pool_bytes += usable;
+	}
+	pthread_mutex_unlock(&mtx_pool);
+	if (!keep) buffer_free(ptr);
+}
+
+/* Free the buffers kept in the pool. */
+void pool_release(void)
+{
+	pthread_mutex_lock(&mtx_pool);
+	for (int c = 0; c < POOL_CLASSES; c++) {
+		while (pool_lists[c]) {
+			struct pool_buffer *buffer = pool_lists[c];
+			pool_lists[c] = buffer->next;
+			buffer_free(buffer);
+		}
+	}
+	pool_bytes = 0;
+	pthread_mutex_unlock(&mtx_pool);
+}
+
+void *mem_malloc(size_t size)
+{
+	void *ptr = pool_malloc(size);
+	mem_count(ptr, 1);
+	return ptr;
+}
+
+/* Like calloc, but a buffer from the pool is zeroed here: use mem_malloc when the caller overwrites every byte. */
+void *mem_calloc(size_t count, size_t size)
+{
+	size_t bytes;
+	if (__builtin_mul_overflow(count, size, &bytes)) return NULL;
+	void *ptr = pool_malloc(bytes);
+	if (ptr) memset(ptr, 0, bytes);
+	mem_count(ptr, 1);
+	return ptr;
+}
+
+void mem_free(void *ptr)
+{
+	mem_count(ptr, -1);
+	pool_free(ptr);
+}
+
+/* Return: the bytes mem_malloc(size) takes from the pool and the memory accounting, 
+ not counting the rounding of malloc itself.
+ */
+static size_t allocated_size(size_t size)
+{
+	if (pool_limit && size > POOL_MIN_BYTES && pool_class(size) < POOL_CLASSES) {
+		size = pool_class_size(pool_class(size));
+	}
+	if (huge_pages != HUGE_PAGES_OFF && size >= HUGE_PAGE_SIZE) {
+		size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	}
+	return size;
+}
+
+/* Return: the row stride of an image w pixels wide, see struct image */
+static inline size_t row_stride(unsigned long w)
+{
+	return (w * sizeof(PPMPixel) + ROW_ALIGN - 1) & ~(size_t)(ROW_ALIGN - 1);
+}
+
+/* Return: row y of img */
+static inline PPMPixel *image_row(const struct image *img, unsigned long y)
+{
+	return (PPMPixel*)((unsigned char*)img->pixels + y * img->stride);
+}
+
+/* Allocate the pixels of a w by h image into img, zeroed if zero is set.
+ Return: 0 on success, -1 on failure.
+ */
+static int image_alloc(struct image *img, unsigned long w, unsigned long h, int zero)
+{
+	img->w = w;
+	img->h = h;
+	img->stride = row_stride(w);
+	size_t bytes;
+	img->pixels = NULL;
+	if (__builtin_mul_overflow(img->stride, h, &bytes)) {
+		errno = ENOMEM;
+	} else {
+		img->pixels = zero ? mem_calloc(h, img->stride) : mem_malloc(bytes);
+	}
+	img->buffer = img->pixels;
+	img->bits = 0;
+	if (!img->pixels) {
+		perror("malloc");
+		return -1;
+	}
+	return 0;
+}
+
+static void image_free(struct image *img)
+{
+	mem_free(img->buffer);
+	img->buffer = NULL;
+	img->pixels = NULL;
+}
+
+/* Return: the bytes of the rows copied by the threads bands of an in-place filter with kernel k of an image w pixels wide,
+ see compute_convolution_inplace_threadfn
+ */
+static inline size_t inplace_history_bytes(unsigned long w, const struct kernel *k, int threads)
+{
+	return (size_t)k->h * threads * row_stride(w);
+}
+
+/* Timeline tracing (--trace FILE). Each thread records its spans (read, filter, join, band, write) into its own 
+ buffer, a list of fixed size chunks that only that thread writes, so recording takes no lock. A buffer is 
+ linked into trace_buffers with a compare and swap when its thread records its first span.
+ At exit the buffers of all (finished) threads are written as Chrome trace events ("X" complete events, 
+ timestamps in microseconds), which chrome://tracing and Perfetto can load.
+ When tracing is disabled each trace point is a single test of trace_enabled.
+ */
+#define TRACE_CHUNK_EVENTS 4096
+
+struct trace_event {
+    const char *name;            //span name, a string literal
+    double start;                //monotonic seconds
+    double end;
+    long image;                  //job id, -1 if none
+    int band;                    //band index, -1 if none
+    char *file;                  //input file name (read spans only), or NULL
+};
+
+struct trace_chunk {
+    struct trace_event events[TRACE_CHUNK_EVENTS];
+    int count;
+    struct trace_chunk *next;
+};
+
+struct trace_buffer {
+    long tid;                    //kernel thread id
+    const char *thread_name;
+    struct trace_chunk *head;    //oldest chunk
+    struct trace_chunk *tail;    //chunk being filled
+    struct trace_buffer *next;   //next buffer in trace_buffers
+};
+
+int trace_enabled = 0;
+static struct trace_buffer *trace_buffers = NULL;   //all buffers, pushed with compare and swap
+static __thread struct trace_buffer *trace_buffer;  //buffer of the calling thread
+static __thread const char *trace_thread_name = "main";
+static __thread long trace_image = -1;              //job the calling thread is working on, for the spans it starts
+
+/* Name the calling thread in the trace (eg. "reader"). */
+static inline void trace_set_thread_name(const char *name)
+{
+	if (trace_enabled) trace_thread_name = name;
+}
+
+/* Return: start time of a span, when tracing is enabled. */
+static inline double trace_begin(void)
+{
+	return trace_enabled ? now_seconds() : 0;
+}
+
+/* Record a span of the calling thread from start (from trace_begin) until now. */
+void trace_record(const char *name, double start, long image, int band, const char *file)
+{
+	struct trace_buffer *buf = trace_buffer;
+	if (!buf) {
+		buf = calloc(1, sizeof(struct trace_buffer));
+		if (!buf) return;
+		buf->tid = syscall(SYS_gettid);
+		buf->thread_name = trace_thread_name;
+		buf->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&trace_buffers, &buf->next, buf, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		trace_buffer = buf;
+	}
+	if (!buf->tail || buf->tail->count == TRACE_CHUNK_EVENTS) {
+		struct trace_chunk *chunk = malloc(sizeof(struct trace_chunk));
+		if (!chunk) return;
+		chunk->count = 0;
+		chunk->next = NULL;
+		if (buf->tail) {
+			buf->tail->next = chunk;
+		} else {
+			buf->head = chunk;
+		}
+		buf->tail = chunk;
+	}
+	struct trace_event *e = &buf->tail->events[buf->tail->count++];
+	e->name = name;
+	e->start = start;
+	e->end = now_seconds();
+	e->image = image;
+	e->band = band;
+	e->file = file ? strdup(file) : NULL;
+}
+
+/* Map the coordinate c, possibly outside of 0 to n - 1 (by up to a kernel radius), to the pixel the filter sees 
+ there with border mode mode.
+ Return: the coordinate, or -1 for a black pixel.
+ */
+static inline long border_coordinate(enum border_mode mode, long c, long n)
+{
+	if (c >= 0 && c < n) return c;
+	switch (mode) {
+	case BORDER_WRAP:
+		c %= n;
+		return c < 0 ? c + n : c;
+	case BORDER_CLAMP:
+		return c < 0 ? 0 : n - 1;
+	case BORDER_MIRROR: {
+		if (n == 1) return 0;
+		// the reflections repeat every 2 * (n - 1) pixels
+		long period = 2 * (n - 1);
+		c %= period;
+		if (c < 0) c += period;
+		return c < n ? c : period - c;
+	}
+	default:
+		return -1;
+	}
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+typedef unsigned char u8x16 __attribute__((vector_size(16)));
+
+/* Return: the bits of 16 pixels at p for threshold_row, the first pixel in the high bit.
+ Every sample is compared with threshold in one byte lane, movemask gathers one bit per sample, and the 3 bits of a 
+ pixel are or-ed into its first one before the pixel bits are gathered 4 at a time by a multiply.
+ */
+static inline unsigned threshold_16(const unsigned char *p, const u8x16 threshold)
+{
+	uint64_t mask = 0;
+	for (int i = 0; i < 3; i++) {
+		u8x16 v;
+		memcpy(&v, p + 16 * i, sizeof v);
+		mask |= (uint64_t)_mm_movemask_epi8((__m128i)(v >= threshold)) << 16 * i;
+	}
+	mask |= mask >> 1 | mask >> 2;
+	unsigned bits = 0;
+	for (int i = 0; i < 4; i++) {
+		// the bits 0, 3, 6 and 9 of a group of 4 pixels, times 0x1111, land at bits 12, 11, 10 and 9, with no carries
+		bits = bits << 4 | ((mask >> 12 * i & 0x249) * 0x1111 >> 9 & 0xf);
+	}
+	return bits;
+}
+#endif
+
+/* Pack the w pixels of row into bits, 8 per byte with the first pixel in the high bit as in a PBM (P4) row: a bit is 1
+ (black in a PBM) when a component of its pixel is at least threshold, so edges are set. bits may be row itself: 
+ each byte is stored after the pixels it packs have been read, and never past them.
+ */
+static void threshold_row(const PPMPixel *row, unsigned long w, int threshold, unsigned char *bits)
+{
+	unsigned long x0 = 0;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+	const u8x16 t = (u8x16){0} + (unsigned char)threshold;
+	for (; x0 + 16 <= w; x0 += 16) {
+		unsigned b = threshold_16((const unsigned char*)&row[x0], t);
+		bits[x0 / 8] = b >> 8;
+		bits[x0 / 8 + 1] = b;
+	}
+#endif
+	for (; x0 < w; x0 += 8) {
+		unsigned long n = w - x0 < 8 ? w - x0 : 8;
+		unsigned char byte = 0;
+		for (unsigned long i = 0; i < n; i++) {
+			const PPMPixel *px = &row[x0 + i];
+			unsigned char max = px->r > px->g ? px->r : px->g;
+			if (px->b > max) max = px->b;
+			byte |= (max >= threshold) << (7 - i);
+		}
+		bits[x0 / 8] = byte;
+	}
+}
+
+/* Called by the band computations that write whole rows (see threshold_fused) once row of the result of band p is 
+ computed: with threshold=N, pack it into bits in place while it is still in the cache.
+ */
+static inline void band_row_done(const struct parameter *p, PPMPixel *row)
+{
+	if (p->threshold) threshold_row(row, p->result->w, p->threshold, (unsigned char*)row);
+}
+
+/* Band computation packing the rows of band p into bits after the band computations that do not do it themselves
+ (the reference and the tiled variants, and the in-place one).
+ */
+void *compute_threshold_threadfn(void *params)
+{
+	struct parameter* p = (struct parameter*) params;
+	for (unsigned long y = p->start - p->halo; y < p->start - p->halo + p->size; y++) {
+		PPMPixel *row = image_row(p->result, y);
+		threshold_row(row, p->result->w, p->threshold, (unsigned char*)row);
+	}
+	return NULL;
+}
+
+/*This is the thread function. It will compute the new values for the region of image specified in params (start to start+size) 
+	using convolution. For each pixel in the input image, the filter is conceptually placed on top ofthe image with its origin
+    lying on that pixel. The  values  of  each  input  image  pixel  under  the  mask  are  multiplied  by the corresponding 
+	filter values. Truncate values smaller than zero to zero and larger than 255 to 255. The results are summed together to 
+    yield a single output value that is placed in the output image at the location of the pixel being processed on the input.
+ 
+ */
+
+void *compute_laplacian_threadfn(void *params)
+{
+    struct parameter* p = (struct parameter*) params;
+	const struct image *image = p->image;
+	unsigned long w = image->w;
+	unsigned long h = image->h;
+	unsigned long halo = p->halo;
+	unsigned long start = p->start;
+	unsigned long size = p->size;
+	enum border_mode border = p->border;
+
+    int laplacian[FILTER_WIDTH][FILTER_HEIGHT] =
+    {
+        {-1, -1, -1},
+        {-1,  8, -1},
+        {-1, -1, -1}
+    };
+
+    int red, green, blue;   
+	long x_coordinate;
+	long y_coordinate;
+	for (unsigned long img_y = start; img_y < start + size; img_y++) {
+		for (unsigned long img_x  = halo; img_x < w - halo; img_x++) {
+			red = 0;
+			green = 0;
+			blue = 0;
+			for (int filter_x = 0; filter_x < FILTER_WIDTH; filter_x++) {
+				for (int filter_y = 0; filter_y < FILTER_HEIGHT; filter_y++) {
+					x_coordinate = border_coordinate(border, (long)img_x - FILTER_WIDTH / 2 + filter_x, w);
+					y_coordinate = border_coordinate(border, (long)img_y - FILTER_HEIGHT / 2 + filter_y, h);
+					if (x_coordinate < 0 || y_coordinate < 0) continue;
+					const PPMPixel *pixel = &image_row(image, y_coordinate)[x_coordinate];
+					red += pixel->r * laplacian[filter_y][filter_x];
+					green += pixel->g * laplacian[filter_y][filter_x];
+					blue += pixel->b * laplacian[filter_y][filter_x];
+				}
+			}
+			// restrict colors to values between 0 and RGB_COMPONENT_COLOR
+			red = red < 0 ? 0 : red;
+			red = red > RGB_COMPONENT_COLOR ? RGB_COMPONENT_COLOR : red;		
+			green = green < 0 ? 0: green;
+			green = green > RGB_COMPONENT_COLOR ? RGB_COMPONENT_COLOR : green;		
+			blue = blue < 0 ? 0 : blue;
+			blue = blue > RGB_COMPONENT_COLOR ? RGB_COMPONENT_COLOR : blue;			
+
+			PPMPixel *out = &image_row(p->result, img_y - halo)[img_x - halo];
+			out->r = red; 
+			out->g = green; 
+			out->b = blue;
+		}
+	}	
+    return NULL; // nothing to return
+}
+
+/* Clamp a filter sum to 0..RGB_COMPONENT_COLOR */
+static inline unsigned char clamp_color(int value)
+{
+	return value < 0 ? 0 : value > RGB_COMPONENT_COLOR ? RGB_COMPONENT_COLOR : value;
+}
+
+/* Filter the sample i (a color component) of a row of samples, its neighbours being the samples i - 3 and i + 3 of 
+ the row and of the rows above and below it.
+ */
+static inline unsigned char laplacian_sample(const unsigned char *above, const unsigned char *row, const unsigned char *below, 
+                                             unsigned long i)
+{
+	return clamp_color(LAPLACIAN_CENTER * row[i] + LAPLACIAN_NEIGHBOUR * (above[i - 3] + above[i] + above[i + 3] + row[i - 3] 
+	                   + row[i + 3] + below[i - 3] + below[i] + below[i + 3]));
+}
+
+typedef unsigned char u8x8 __attribute__((vector_size(8)));
+typedef int16_t i16x8 __attribute__((vector_size(16)));
+
+/* Return: the 8 samples at p, widened to int16_t lanes */
+static inline i16x8 load_i16x8(const unsigned char *p)
+{
+	u8x8 v;
+	memcpy(&v, p, sizeof v);
+	return __builtin_convertvector(v, i16x8);
+}
+
+/* Filter the pixels x0 to x1 - 1 of a row, whose neighbours are all inside the image: 
+ above, row and below are the rows y - 1, y and y + 1, and out is the result pixel of x0.
+ This is the same for every border mode, and has no coordinate arithmetic besides the x +- 1.
+ The color components are filtered as one row of samples, 8 at a time in int16_t lanes (see LAPLACIAN_ACCUM16), 
+ which cannot overflow as every partial sum lies between LAPLACIAN_SUM_MIN and LAPLACIAN_SUM_MAX.
+ */
+static inline void laplacian_interior_row(const PPMPixel *above, const PPMPixel *row, const PPMPixel *below, 
+                                          unsigned long x0, unsigned long x1, PPMPixel *out)
+{
+	const unsigned char *a = (const unsigned char*)above, *r = (const unsigned char*)row, *b = (const unsigned char*)below;
+	unsigned char *o = (unsigned char*)out - 3 * x0;
+	unsigned long i = 3 * x0, end = 3 * x1;
+	if (LAPLACIAN_ACCUM16) {
+		const i16x8 zero = {0}, max = zero + RGB_COMPONENT_COLOR;
+		for (; i + 8 <= end; i += 8) {
+			i16x8 sum = LAPLACIAN_CENTER * load_i16x8(r + i) + LAPLACIAN_NEIGHBOUR * (load_i16x8(a + i - 3) + load_i16x8(a + i) 
+			            + load_i16x8(a + i + 3) + load_i16x8(r + i - 3) + load_i16x8(r + i + 3) + load_i16x8(b + i - 3) 
+			            + load_i16x8(b + i) + load_i16x8(b + i + 3));
+			sum &= sum > zero;
+			i16x8 over = sum > max;
+			sum = (sum & ~over) | (max & over);
+			u8x8 v = __builtin_convertvector(sum, u8x8);
+			memcpy(o + i, &v, sizeof v);
+		}
+	}
+	for (; i < end; i++) {
+		o[i] = laplacian_sample(a, r, b, i);
+	}
+}
+
+/* Filter the pixel (x, y) of image, some of whose neighbours are past the edges, with border mode mode.
+ Always inlined with a constant mode, so each mode gets its own specialized border pass.
+ */
+static inline __attribute__((always_inline)) void laplacian_border_pixel(enum border_mode mode, const struct image *image, 
+                                                                          unsigned long x, unsigned long y, PPMPixel *out)
+{
+	int red = 0, green = 0, blue = 0;
+	for (int dy = -1; dy <= 1; dy++) {
+		long ny = border_coordinate(mode, (long)y + dy, image->h);
+		if (ny < 0) continue;
+		const PPMPixel *row = image_row(image, ny);
+		for (int dx = -1; dx <= 1; dx++) {
+			long nx = border_coordinate(mode, (long)x + dx, image->w);
+			if (nx < 0) continue;
+			const PPMPixel *px = &row[nx];
+			int weight = dx == 0 && dy == 0 ? 8 : -1;
+			red += weight * px->r;
+			green += weight * px->g;
+			blue += weight * px->b;
+		}
+	}
+	out->r = clamp_color(red);
+	out->g = clamp_color(green);
+	out->b = clamp_color(blue);
+}
+
+/* The border pass of one mode over row y: the whole row for the first and last rows, 
+ else only its first and last pixels. out is the result row.
+ */
+static inline __attribute__((always_inline)) void laplacian_border_row(enum border_mode mode, const struct image *image, 
+                                                                        unsigned long y, int whole_row, PPMPixel *out)
+{
+	unsigned long w = image->w;
+	if (whole_row) {
+		for (unsigned long x = 0; x < w; x++) {
+			laplacian_border_pixel(mode, image, x, y, &out[x]);
+		}
+		return;
+	}
+	laplacian_border_pixel(mode, image, 0, y, &out[0]);
+	if (w > 1) laplacian_border_pixel(mode, image, w - 1, y, &out[w - 1]);
+}
+
+typedef void (*border_row_fn)(const struct image *image, unsigned long y, int whole_row, PPMPixel *out);
+
+static void laplacian_border_row_wrap(const struct image *image, unsigned long y, int whole_row, PPMPixel *out)
+{
+	laplacian_border_row(BORDER_WRAP, image, y, whole_row, out);
+}
+
+static void laplacian_border_row_clamp(const struct image *image, unsigned long y, int whole_row, PPMPixel *out)
+{
+	laplacian_border_row(BORDER_CLAMP, image, y, whole_row, out);
+}
+
+static void laplacian_border_row_mirror(const struct image *image, unsigned long y, int whole_row, PPMPixel *out)
+{
+	laplacian_border_row(BORDER_MIRROR, image, y, whole_row, out);
+}
+
+static void laplacian_border_row_zero(const struct image *image, unsigned long y, int whole_row, PPMPixel *out)
+{
+	laplacian_border_row(BORDER_ZERO, image, y, whole_row, out);
+}
+
+static const border_row_fn laplacian_border_rows[NUM_BORDER_MODES] = {
+	[BORDER_WRAP] = &laplacian_border_row_wrap,
+	[BORDER_CLAMP] = &laplacian_border_row_clamp,
+	[BORDER_MIRROR] = &laplacian_border_row_mirror,
+	[BORDER_ZERO] = &laplacian_border_row_zero,
+};
+
+/* Band computation split into an interior loop, which is the same for every border mode and never leaves the image,
+ and a border pass specialized for the border mode, for the first and last rows and columns. 
+ A region of interest (halo 1) has its border already filled in by read_region, so it is all interior.
+ */
+void *compute_laplacian_split_threadfn(void *params)
+{
+	struct parameter* p = (struct parameter*) params;
+	const struct image *image = p->image;
+	unsigned long w = image->w;
+	unsigned long h = image->h;
+	unsigned long halo = p->halo;
+	border_row_fn border_row = laplacian_border_rows[p->border];
+	for (unsigned long y = p->start; y < p->start + p->size; y++) {
+		PPMPixel *out = image_row(p->result, y - halo);
+		if (halo) {
+			laplacian_interior_row(image_row(image, y - 1), image_row(image, y), image_row(image, y + 1), 1, w - 1, out);
+		} else if (y == 0 || y == h - 1) {
+			border_row(image, y, 1, out);
+		} else {
+			if (w > 2) laplacian_interior_row(image_row(image, y - 1), image_row(image, y), image_row(image, y + 1), 1, w - 1, out + 1);
+			border_row(image, y, 0, out);
+		}
+		band_row_done(p, out);
+	}
+	return NULL;
+}
+
+/* Convolution engine: any odd-sized integer kernel (struct kernel), up to KERNEL_MAX_SIZE by KERNEL_MAX_SIZE.
+ A row is computed from the array of the kernel->h rows centered on it, so the same code serves whole images, 
+ regions of interest, strips and in-place filtering, whatever the rows are copies of.
+ */
+
+/* Return: whether every partial sum of kernel k over 8-bit samples, and its divisor, fit in int16_t, see 
+ LAPLACIAN_SUM_MAX 
+ */
+static inline __attribute__((always_inline)) int kernel_fits_int16(const struct kernel *k)
+{
+	int max = 0, min = 0;
+	for (int i = 0; i < k->w * k->h; i++) {
+		if (k->coeffs[i] > 0) {
+			max += k->coeffs[i];
+		} else {
+			min += k->coeffs[i];
+		}
+	}
+	return RGB_COMPONENT_COLOR * max <= INT16_MAX && RGB_COMPONENT_COLOR * min >= INT16_MIN && abs(k->divisor) <= INT16_MAX;
+}
+
+/* See kernel_row_fn. Like laplacian_interior_row, the color components are filtered as one row of samples, 8 at a 
+ time in int16_t lanes when the sums of k fit (see kernel_fits_int16), else one at a time in int.
+ Always inlined: with a constant kernel the taps are unrolled and the coefficients folded in, the zero ones 
+ dropped, see the kernel_catalog.
+ */
+static inline __attribute__((always_inline)) void convolve_row(const struct kernel *k, const PPMPixel *const *rows, 
+                                                                unsigned long x0, unsigned long x1, PPMPixel *out)
+{
+	long rx = k->w / 2;
+	unsigned char *o = (unsigned char*)out - 3 * x0;
+	unsigned long i = 3 * x0, end = 3 * x1;
+	if (kernel_fits_int16(k)) {
+		const i16x8 zero = {0}, max = zero + RGB_COMPONENT_COLOR;
+		for (; i + 8 <= end; i += 8) {
+			i16x8 sum = zero;
+// the largest kernels of the catalog, the pragma does not expand macros
+#pragma GCC unroll 7
+			for (int ky = 0; ky < k->h; ky++) {
+				const unsigned char *row = (const unsigned char*)rows[ky] + i - 3 * rx;
+#pragma GCC unroll 7
+				for (int kx = 0; kx < k->w; kx++) {
+					int c = k->coeffs[ky * k->w + kx];
+					if (c) sum += (int16_t)c * load_i16x8(row + 3 * kx);
+				}
+			}
+			if (k->divisor != 1) sum /= (int16_t)k->divisor;
+			sum &= sum > zero;
+			i16x8 over = sum > max;
+			sum = (sum & ~over) | (max & over);
+			u8x8 v = __builtin_convertvector(sum, u8x8);
+			memcpy(o + i, &v, sizeof v);
+		}
+	}
+	for (; i < end; i++) {
+		int sum = 0;
+		for (int ky = 0; ky < k->h; ky++) {
+			const unsigned char *row = (const unsigned char*)rows[ky] + i - 3 * rx;
+			for (int kx = 0; kx < k->w; kx++) {
+				sum += k->coeffs[ky * k->w + kx] * row[3 * kx];
+			}
+		}
+		o[i] = clamp_color(sum / k->divisor);
+	}
+}
+
+/* convolve_row for a kernel only known at run time */
+static void convolve_row_generic(const struct kernel *k, const PPMPixel *const *rows, unsigned long x0, unsigned long x1, 
+                                 PPMPixel *out)
+{
+	convolve_row(k, rows, x0, x1, out);
+}
+
+/* Filter the pixel x of a row, with kernel k reaching past its left or right edge, with border mode mode. rows are 
+ the k->h rows the filter sees around it (NULL for black rows past the edges with BORDER_ZERO), so only x is mapped.
+ */
+static void convolve_edge_pixel(const struct kernel *k, enum border_mode mode, const PPMPixel *const *rows, 
+                                unsigned long w, unsigned long x, PPMPixel *out)
+{
+	long rx = k->w / 2;
+	int red = 0, green = 0, blue = 0;
+	for (int ky = 0; ky < k->h; ky++) {
+		if (!rows[ky]) continue;
+		for (int kx = 0; kx < k->w; kx++) {
+			int c = k->coeffs[ky * k->w + kx];
+			long nx = border_coordinate(mode, (long)x - rx + kx, w);
+			if (!c || nx < 0) continue;
+			const PPMPixel *px = &rows[ky][nx];
+			red += c * px->r;
+			green += c * px->g;
+			blue += c * px->b;
+		}
+	}
+	out->r = clamp_color(red / k->divisor);
+	out->g = clamp_color(green / k->divisor);
+	out->b = clamp_color(blue / k->divisor);
+}
+
+/* Filter a row of an image w pixels wide with kernel k into out, whose first pixel is the result of the input pixel halo:
+ rows are the k->h rows the filter sees around it (NULL for black rows past the edges with BORDER_ZERO). 
+ With a halo (at least the kernel radius) the kernel never leaves the rows, else the pixels it does leave them for, 
+ next to the edges, are filtered with border mode mode.
+ */
+static void convolve_image_row(const struct kernel *k, kernel_row_fn row_fn, enum border_mode mode, const PPMPixel *const *rows,
+                               unsigned long w, unsigned long halo, PPMPixel *out)
+{
+	if (halo) {
+		row_fn(k, rows, halo, w - halo, out);
+		return;
+	}
+	unsigned long rx = k->w / 2;
+	int complete = w > 2 * rx;
+	for (int ky = 0; ky < k->h; ky++) {
+		if (!rows[ky]) complete = 0;
+	}
+	// the interior is x0 to x1 - 1, the rest is filtered pixel by pixel
+	unsigned long x0 = complete ? rx : w, x1 = complete ? w - rx : w;
+	if (x0 < x1) row_fn(k, rows, x0, x1, out + x0);
+	for (unsigned long x = 0; x < w; x++) {
+		if (x == x0) x = x1;
+		if (x < w) convolve_edge_pixel(k, mode, rows, w, x, &out[x]);
+	}
+}
+
+/* Copy into row the row y of image the filter sees with border mode mode, y being at most a kernel radius past the edges.
+ A row past the edges with BORDER_ZERO is black.
+ */
+static void copy_border_row(const struct image *image, enum border_mode mode, long y, PPMPixel *row)
+{
+	long ny = border_coordinate(mode, y, image->h);
+	if (ny < 0) {
+		memset(row, 0, image->w * sizeof(PPMPixel));
+	} else {
+		memcpy(row, image_row(image, ny), image->w * sizeof(PPMPixel));
+	}
+}
+
+/* Band computation of the convolution engine, for any kernel (variant=engine, and every kernel but the Laplacian).
+ */
+void *compute_convolution_threadfn(void *params)
+{
+	struct parameter* p = (struct parameter*) params;
+	const struct image *image = p->image;
+	const struct kernel *k = p->kernel;
+	long ry = k->h / 2;
+	const PPMPixel *rows[KERNEL_MAX_SIZE];
+	for (unsigned long y = p->start; y < p->start + p->size; y++) {
+		for (int ky = 0; ky < k->h; ky++) {
+			long ny = border_coordinate(p->border, (long)y - ry + ky, image->h);
+			rows[ky] = ny < 0 ? NULL : image_row(image, ny);
+		}
+		PPMPixel *out = image_row(p->result, y - p->halo);
+		convolve_image_row(k, p->row_fn, p->border, rows, image->w, p->halo, out);
+		band_row_done(p, out);
+	}
+	return NULL;
+}
+
+/* Return: history row i of the in-place band p */
+static inline PPMPixel *history_row(const struct parameter *p, unsigned long i)
+{
+	return (PPMPixel*)((unsigned char*)p->history + i * p->image->stride);
+}
+
+/* Return: the history row of the in-place band p that holds the input row y, for y from p->start - ry to the row 
+ being filtered (ry being the kernel radius): the ry + 1 first history rows are used in turn.
+ */
+static inline unsigned long history_slot(const struct parameter *p, unsigned long y)
+{
+	unsigned long ry = p->kernel->h / 2;
+	return (y + ry - p->start) % (ry + 1);
+}
+
+/* In-place band computation (inplace=1): each result pixel overwrites the input pixel it is centered on, so 
+ p->result is a view of p->image (offset by the halo for a region of interest). 
+ Row y can only be overwritten once the rows below it that need it are computed, so the band keeps copies of the row 
+ it is computing and of the ry rows before it, ry being the kernel radius (for the 3 by 3 Laplacian: the row and the 
+ one before it). The ry rows above and below the band belong to the neighbouring bands, which may overwrite them first:
+ filter_bands copies them into the history (see history_slot, the rows below follow the ry + 1 slots) before any band runs.
+ */
+void *compute_convolution_inplace_threadfn(void *params)
+{
+	struct parameter* p = (struct parameter*) params;
+	const struct image *image = p->image;
+	const struct kernel *k = p->kernel;
+	int ry = k->h / 2;
+	unsigned long end = p->start + p->size;
+	const PPMPixel *rows[KERNEL_MAX_SIZE];
+	for (unsigned long y = p->start; y < end; y++) {
+		PPMPixel *out = image_row(image, y);
+		memcpy(history_row(p, history_slot(p, y)), out, image->w * sizeof(PPMPixel));
+		for (int ky = 0; ky < k->h; ky++) {
+			unsigned long row_y = y - ry + ky;   // wraps around for the rows above 0, as in history_slot
+			if (ky <= ry) {
+				rows[ky] = history_row(p, history_slot(p, row_y));
+			} else if (row_y < end) {
+				rows[ky] = image_row(image, row_y);
+			} else {
+				rows[ky] = history_row(p, ry + 1 + row_y - end);
+			}
+		}
+		convolve_image_row(k, p->row_fn, p->border, rows, image->w, p->halo, out + p->halo);
+	}
+	return NULL;
+}
+
+/* Kernels of the catalog, named with kernel=name. Each gets its own specialized row computation. */
+static const struct kernel laplacian8_kernel = LAPLACIAN8_KERNEL;
+static const struct kernel laplacian4_kernel = { 3, 3, 1, { 0, -1,  0, 
+                                                           -1,  4, -1, 
+                                                            0, -1,  0 } };
+static const struct kernel sobel_x_kernel = { 3, 3, 1, { -1, 0, 1, 
+                                                        -2, 0, 2, 
+                                                        -1, 0, 1 } };
+static const struct kernel sobel_y_kernel = { 3, 3, 1, { -1, -2, -1, 
+                                                         0,  0,  0, 
+                                                         1,  2,  1 } };
+static const struct kernel prewitt_x_kernel = { 3, 3, 1, { -1, 0, 1, 
+                                                          -1, 0, 1, 
+                                                          -1, 0, 1 } };
+static const struct kernel prewitt_y_kernel = { 3, 3, 1, { -1, -1, -1, 
+                                                           0,  0,  0, 
+                                                           1,  1,  1 } };
+static const struct kernel scharr_x_kernel = { 3, 3, 1, {  -3, 0,  3, 
+                                                         -10, 0, 10, 
+                                                          -3, 0,  3 } };
+static const struct kernel scharr_y_kernel = { 3, 3, 1, { -3, -10, -3, 
+                                                          0,   0,  0, 
+                                                          3,  10,  3 } };
+// Laplacian of Gaussian
+static const struct kernel log5_kernel = { 5, 5, 1, {  0,  0, -1,  0,  0, 
+                                                       0, -1, -2, -1,  0, 
+                                                      -1, -2, 16, -2, -1, 
+                                                       0, -1, -2, -1,  0, 
+                                                       0,  0, -1,  0,  0 } };
+// blurs: the binomial 1 4 6 4 1 and the mean of the 5 by 5 pixels
+static const struct kernel gauss5_kernel = { 5, 5, 256, { 1,  4,  6,  4, 1,
+                                                          4, 16, 24, 16, 4,
+                                                          6, 24, 36, 24, 6,
+                                                          4, 16, 24, 16, 4,
+                                                          1,  4,  6,  4, 1 } };
+static const struct kernel box5_kernel = { 5, 5, 25, { 1, 1, 1, 1, 1,
+                                                       1, 1, 1, 1, 1,
+                                                       1, 1, 1, 1, 1,
+                                                       1, 1, 1, 1, 1,
+                                                       1, 1, 1, 1, 1 } };
+
+#define CATALOG_ROW_FN(name)                                                                                             \
+static void convolve_row_##name(const struct kernel *k, const PPMPixel *const *rows, unsigned long x0, unsigned long x1, \
+                                  PPMPixel *out)                                                                         \
+{                                                                                                                        \
+	(void)k;    /* the coefficients are those of name, folded in at compile time */                                      \
+	convolve_row(&name, rows, x0, x1, out);                                                                              \
+}
+
+CATALOG_ROW_FN(laplacian8_kernel)
+CATALOG_ROW_FN(laplacian4_kernel)
+CATALOG_ROW_FN(sobel_x_kernel)
+CATALOG_ROW_FN(sobel_y_kernel)
+CATALOG_ROW_FN(prewitt_x_kernel)
+CATALOG_ROW_FN(prewitt_y_kernel)
+CATALOG_ROW_FN(scharr_x_kernel)
+CATALOG_ROW_FN(scharr_y_kernel)
+CATALOG_ROW_FN(log5_kernel)
+CATALOG_ROW_FN(gauss5_kernel)
+CATALOG_ROW_FN(box5_kernel)
+
+struct catalog_kernel {
+    const char *name;
+    const struct kernel *kernel;
+    kernel_row_fn row_fn;        //convolve_row specialized for kernel
+};
+
+/* The first kernel is the default */
+static const struct catalog_kernel kernel_catalog[] = {
+	{"laplacian8", &laplacian8_kernel, &convolve_row_laplacian8_kernel},
+	{"laplacian4", &laplacian4_kernel, &convolve_row_laplacian4_kernel},
+	{"sobel-x",    &sobel_x_kernel,    &convolve_row_sobel_x_kernel},
+	{"sobel-y",    &sobel_y_kernel,    &convolve_row_sobel_y_kernel},
+	{"prewitt-x",  &prewitt_x_kernel,  &convolve_row_prewitt_x_kernel},
+	{"prewitt-y",  &prewitt_y_kernel,  &convolve_row_prewitt_y_kernel},
+	{"scharr-x",   &scharr_x_kernel,   &convolve_row_scharr_x_kernel},
+	{"scharr-y",   &scharr_y_kernel,   &convolve_row_scharr_y_kernel},
+	{"log5",       &log5_kernel,       &convolve_row_log5_kernel},
+	{"gauss5",     &gauss5_kernel,     &convolve_row_gauss5_kernel},
+	{"box5",       &box5_kernel,       &convolve_row_box5_kernel},
+};
+
+#define NUM_CATALOG_KERNELS (int)(sizeof kernel_catalog / sizeof kernel_catalog[0])
+
+/* Return: whether kernels a and b compute the same thing */
+static int kernel_equal(const struct kernel *a, const struct kernel *b)
+{
+	return a->w == b->w && a->h == b->h && a->divisor == b->divisor && 
+	       memcmp(a->coeffs, b->coeffs, a->w * a->h * sizeof(int)) == 0;
+}
+
+/* Return: index in kernel_catalog of the kernel equal to k (whether it was named or given by its coefficients), 
+ or -1 if there is none.
+ */
+static int find_catalog_kernel(const struct kernel *k)
+{
+	for (int i = 0; i < NUM_CATALOG_KERNELS; i++) {
+		if (kernel_equal(kernel_catalog[i].kernel, k)) return i;
+	}
+	return -1;
+}
+
+/* Return: the row computation for kernel k, specialized when it is in the catalog */
+static kernel_row_fn find_row_fn(const struct kernel *k)
+{
+	int i = find_catalog_kernel(k);
+	return i < 0 ? &convolve_row_generic : kernel_catalog[i].row_fn;
+}
+
+/* Return: the radius of kernel k, the border of input pixels a region of interest needs around it */
+static inline unsigned long kernel_radius(const struct kernel *k)
+{
+	return (k->w > k->h ? k->w : k->h) / 2;
+}
+
+static long long gcd_ll(long long a, long long b)
+{
+	a = llabs(a);
+	b = llabs(b);
+	while (b) {
+		long long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Divide the n numbers of v by their greatest common divisor, so that the first one that is not zero is positive */
+static void make_primitive(long long *v, int n)
+{
+	long long g = 0;
+	int first = -1;
+	for (int i = 0; i < n; i++) {
+		g = gcd_ll(g, v[i]);
+		if (first < 0 && v[i]) first = i;
+	}
+	if (first < 0) return;
+	if (v[first] < 0) g = -g;
+	for (int i = 0; i < n; i++) v[i] /= g;
+}
+
+/* Split kernel k into terms (see struct kernel_passes): the rows of the terms are one or two rows of k made primitive,
+ and the columns are the factors of every row of k over them.
+ Return: 0 on success, -1 if k is zero, has a rank above 2, or its sums could leave the ranges of struct kernel_passes.
+ */
+static int split_kernel(const struct kernel *k, struct kernel_passes *kp)
+{
+	long long rows[2][KERNEL_MAX_SIZE], cols[2][KERNEL_MAX_SIZE];
+	int terms = 0, first = 0;    // first: a coefficient of rows[0] that is not zero
+	for (int y = 0; y < k->h && terms < 2; y++) {
+		const int *row = &k->coeffs[y * k->w];
+		int independent = 0;
+		for (int x = 0; x < k->w; x++) {
+			independent |= terms ? (long long)row[x] * rows[0][first] != (long long)row[first] * rows[0][x] : row[x] != 0;
+		}
+		if (!independent) continue;
+		for (int x = 0; x < k->w; x++) rows[terms][x] = row[x];
+		make_primitive(rows[terms], k->w);
+		while (!rows[0][first]) first++;
+		terms++;
+	}
+	if (!terms) return -1;
+	// with two terms each row is (a * rows[0] + b * rows[1]) / det, a and b solved on the columns first and second
+	int second = 0;
+	long long det = 1;
+	if (terms == 2) {
+		for (second = 0; second < k->w; second++) {
+			det = rows[0][first] * rows[1][second] - rows[0][second] * rows[1][first];
+			if (det) break;
+		}
+	}
+	long long g = det;
+	for (int y = 0; y < k->h; y++) {
+		const int *row = &k->coeffs[y * k->w];
+		long long a, b = 0;
+		if (terms == 1) {
+			a = row[first] / rows[0][first];
+		} else {
+			a = row[first] * rows[1][second] - row[second] * rows[1][first];
+			b = rows[0][first] * row[second] - rows[0][second] * row[first];
+		}
+		for (int x = 0; x < k->w; x++) {
+			long long sum = a * rows[0][x] + (terms == 2 ? b * rows[1][x] : 0);
+			if (sum != det * row[x]) return -1;
+		}
+		cols[0][y] = a;
+		cols[1][y] = b;
+		g = gcd_ll(g, gcd_ll(a, b));
+	}
+	if (det < 0) g = -g;
+	// the largest sums of the horizontal passes and of the terms over 8-bit samples
+	long long bound = 0;
+	for (int t = 0; t < terms; t++) {
+		long long row_sum = 0, col_sum = 0;
+		for (int x = 0; x < k->w; x++) row_sum += llabs(rows[t][x]);
+		for (int y = 0; y < k->h; y++) col_sum += llabs(cols[t][y] / g);
+		if (row_sum * RGB_COMPONENT_COLOR > INT16_MAX) return -1;
+		bound += row_sum * col_sum * RGB_COMPONENT_COLOR;
+	}
+	if (bound >= PASSES_SUM_LIMIT || det / g * llabs(k->divisor) > INT32_MAX) return -1;
+	kp->terms = terms;
+	kp->sum_max = bound;
+	kp->scale = det / g;
+	for (int t = 0; t < terms; t++) {
+		for (int x = 0; x < k->w; x++) kp->row[t][x] = rows[t][x];
+		for (int y = 0; y < k->h; y++) kp->col[t][y] = cols[t][y] / g;
+	}
+	return 0;
+}
+
+/* Return: whether filtering with the terms kp of kernel k is faster than with k itself, counting a multiply-add per
+ coefficient that is not zero. The two passes cost about two more for the ring of a tile (see compute_passes_threadfn). 
+ A kernel of the catalog whose sums fit in int16_t has its coefficients folded into unrolled code over 8 int16_t lanes 
+ (see convolve_row), which makes its multiply-adds about half the cost of the ones of the passes.
+ */
+static int passes_cheaper(const struct kernel *k, const struct kernel_passes *kp)
+{
+	int direct = 0, passes = 0;
+	for (int i = 0; i < k->w * k->h; i++) direct += k->coeffs[i] != 0;
+	for (int t = 0; t < kp->terms; t++) {
+		for (int x = 0; x < k->w; x++) passes += kp->row[t][x] != 0;
+		for (int y = 0; y < k->h; y++) passes += kp->col[t][y] != 0;
+	}
+	if (find_catalog_kernel(k) >= 0 && kernel_fits_int16(k)) return 2 * passes < direct;
+	return passes + 2 < direct;
+}
+
+typedef int16_t i16x4 __attribute__((vector_size(8)));
+typedef int32_t i32x4 __attribute__((vector_size(16)));
+typedef float f32x4 __attribute__((vector_size(16)));
+
+/* Width in pixels of the column tiles of compute_passes_threadfn: the ring of a tile is
+ 2 * KERNEL_MAX_SIZE * 3 * PASS_TILE int16_t, on the stack of the band thread.
+ */
+#define PASS_TILE 256
+
+/* Horizontal pass: the sums of the pixels x0 to x1 - 1 of row (w pixels wide, NULL for a black row) with the k->w
+ coefficients of coeffs into out, one per sample, 8 samples at a time as in convolve_row. Pixels whose coefficients 
+ reach past the edges are filtered with border mode mode.
+ */
+static void horizontal_pass(const int *coeffs, int kw, enum border_mode mode, const PPMPixel *row, unsigned long w,
+                            unsigned long x0, unsigned long x1, int16_t *out)
+{
+	if (!row) {
+		memset(out, 0, 3 * (x1 - x0) * sizeof(int16_t));
+		return;
+	}
+	unsigned long rx = kw / 2;
+	const unsigned char *s = (const unsigned char*)row;
+	int16_t *o = out - 3 * x0;
+	// the coefficients stay in the row for the pixels lo to hi - 1
+	unsigned long lo = x0 > rx ? x0 : rx;
+	if (lo > x1) lo = x1;
+	unsigned long hi = w > 2 * rx && w - rx < x1 ? w - rx : x1;
+	if (w <= 2 * rx || hi < lo) hi = lo;
+	unsigned long i = 3 * lo, end = 3 * hi;
+	for (; i + 8 <= end; i += 8) {
+		i16x8 sum = {0};
+		const unsigned char *p = s + i - 3 * rx;
+		for (int kx = 0; kx < kw; kx++) {
+			if (coeffs[kx]) sum += (int16_t)coeffs[kx] * load_i16x8(p + 3 * kx);
+		}
+		memcpy(o + i, &sum, sizeof sum);
+	}
+	for (; i < end; i++) {
+		int sum = 0;
+		for (int kx = 0; kx < kw; kx++) sum += coeffs[kx] * s[i + 3 * (kx - (long)rx)];
+		o[i] = sum;
+	}
+	for (unsigned long x = x0; x < x1; x++) {
+		if (x == lo) x = hi;
+		if (x == x1) break;
+		int sum[3] = {0, 0, 0};
+		for (int kx = 0; kx < kw; kx++) {
+			long nx = border_coordinate(mode, (long)x - (long)rx + kx, w);
+			if (nx < 0) continue;
+			for (int c = 0; c < 3; c++) sum[c] += coeffs[kx] * s[3 * nx + c];
+		}
+		for (int c = 0; c < 3; c++) o[3 * x + c] = sum[c];
+	}
+}
+
+/* Return: the sums divided by divisor, rounding toward zero as / does: shifting for a power of 2, else in float, 
+ whose quotients truncate to the exact ones for sums below PASSES_SUM_LIMIT
+ */
+static inline i32x4 divide_i32x4(i32x4 sum, int divisor)
+{
+	if (divisor == 1) return sum;
+	if (divisor > 0 && (divisor & (divisor - 1)) == 0) {
+		return (sum + ((sum >> 31) & (divisor - 1))) >> __builtin_ctz(divisor);
+	}
+	return __builtin_convertvector(__builtin_convertvector(sum, f32x4) / (float)divisor, i32x4);
+}
+
+/* Return: sum clamped to 0..RGB_COMPONENT_COLOR */
+static inline i16x8 clamp_i16x8(i16x8 sum)
+{
+	const i16x8 zero = {0}, max = zero + RGB_COMPONENT_COLOR;
+	sum &= sum > zero;
+	i16x8 over = sum > max;
+	return (sum & ~over) | (max & over);
+}
+
+/* Return: sum clamped to 0..RGB_COMPONENT_COLOR */
+static inline i32x4 clamp_i32x4(i32x4 sum)
+{
+	const i32x4 zero = {0}, max = zero + RGB_COMPONENT_COLOR;
+	sum &= sum > zero;
+	i32x4 over = sum > max;
+	return (sum & ~over) | (max & over);
+}
+
+/* Vertical pass: the n samples of out from the rows of the horizontal passes, rows[t] being the kh rows of term t
+ of kp centered on out, divided by divisor (kp->scale times the divisor of the kernel) and clamped. 8 samples at a time,
+ summed in int16_t lanes when the sums fit (kp->sum_max), else in two halves of int32_t lanes, and divided in int32_t
+ lanes.
+ */
+static void vertical_pass(const struct kernel_passes *kp, int kh, const int16_t *const rows[2][KERNEL_MAX_SIZE],
+                          unsigned long n, int divisor, unsigned char *out)
+{
+	int narrow = kp->sum_max <= INT16_MAX;
+	unsigned long i = 0;
+	for (; i + 8 <= n; i += 8) {
+		i32x4 half[2] = {{0}, {0}};
+		if (narrow) {
+			i16x8 sum = {0};
+			for (int t = 0; t < kp->terms; t++) {
+				for (int ky = 0; ky < kh; ky++) {
+					i16x8 v;
+					memcpy(&v, rows[t][ky] + i, sizeof v);
+					if (kp->col[t][ky]) sum += (int16_t)kp->col[t][ky] * v;
+				}
+			}
+			if (divisor == 1) {
+				u8x8 v = __builtin_convertvector(clamp_i16x8(sum), u8x8);
+				memcpy(out + i, &v, sizeof v);
+				continue;
+			}
+			i16x4 v[2];
+			memcpy(v, &sum, sizeof v);
+			half[0] = __builtin_convertvector(v[0], i32x4);
+			half[1] = __builtin_convertvector(v[1], i32x4);
+		} else {
+			for (int t = 0; t < kp->terms; t++) {
+				for (int ky = 0; ky < kh; ky++) {
+					i16x4 v[2];
+					memcpy(v, rows[t][ky] + i, sizeof v);
+					if (!kp->col[t][ky]) continue;
+					half[0] += kp->col[t][ky] * __builtin_convertvector(v[0], i32x4);
+					half[1] += kp->col[t][ky] * __builtin_convertvector(v[1], i32x4);
+				}
+			}
+		}
+		// the clamped sums fit in the low int16_t of their lanes
+		i16x8 low = (i16x8)clamp_i32x4(divide_i32x4(half[0], divisor));
+		i16x8 high = (i16x8)clamp_i32x4(divide_i32x4(half[1], divisor));
+		u8x8 v = __builtin_convertvector(__builtin_shuffle(low, high, (i16x8){0, 2, 4, 6, 8, 10, 12, 14}), u8x8);
+		memcpy(out + i, &v, sizeof v);
+	}
+	for (; i < n; i++) {
+		int sum = 0;
+		for (int t = 0; t < kp->terms; t++) {
+			for (int ky = 0; ky < kh; ky++) sum += kp->col[t][ky] * rows[t][ky][i];
+		}
+		out[i] = clamp_color(sum / divisor);
+	}
+}
+
+/* Band computation for the kernels that split into one or two terms (see split_kernel): each input row goes through
+ the horizontal pass of each term once, into a ring of the last k->h rows, and each result row is the vertical pass over
+ the ring, at w + h multiply-adds per term instead of w * h.
+ The band is filtered in column tiles of PASS_TILE pixels so that the ring stays in the cache between the passes.
+ */
+void *compute_passes_threadfn(void *params)
+{
+	struct parameter* p = (struct parameter*) params;
+	const struct image *image = p->image;
+	const struct kernel *k = p->kernel;
+	const struct kernel_passes *kp = p->passes;
+	long ry = k->h / 2;
+	long start = p->start, end = p->start + p->size;
+	unsigned long x_end = image->w - p->halo;
+	int divisor = kp->scale * k->divisor;
+	int16_t ring[2][KERNEL_MAX_SIZE][3 * PASS_TILE];
+	const int16_t *rows[2][KERNEL_MAX_SIZE];
+	for (unsigned long x0 = p->halo; x0 < x_end; x0 += PASS_TILE) {
+		unsigned long x1 = x_end - x0 > PASS_TILE ? x0 + PASS_TILE : x_end;
+		for (long y = start; y < end; y++) {
+			// the rows entering the kernel, all of them for the first row; row iy goes to slot (iy - start + ry) % k->h
+			for (long iy = y == start ? y - ry : y + ry; iy <= y + ry; iy++) {
+				long ny = border_coordinate(p->border, iy, image->h);
+				const PPMPixel *row = ny < 0 ? NULL : image_row(image, ny);
+				for (int t = 0; t < kp->terms; t++) {
+					horizontal_pass(kp->row[t], k->w, p->border, row, image->w, x0, x1, ring[t][(iy - start + ry) % k->h]);
+				}
+			}
+			for (int t = 0; t < kp->terms; t++) {
+				for (int ky = 0; ky < k->h; ky++) rows[t][ky] = ring[t][(y - start + ky) % k->h];
+			}
+			PPMPixel *out = image_row(p->result, y - p->halo) + x0 - p->halo;
+			vertical_pass(kp, k->h, rows, 3 * (x1 - x0), divisor, (unsigned char*)out);
+		}
+	}
+	return NULL;
+}
+
+/* FFT convolution for large kernels: the direct engine takes w * h multiply-adds per sample, the FFT a number that 
+ grows with the log of the tile size. Tiles of n by n input pixels (n a power of 2) are filtered by overlap-save: 
+ the circular convolution of a tile with the kernel is exact except for the kernel->w - 1 last columns and 
+ kernel->h - 1 last rows, which wrap around, so each tile yields n - w + 1 by n - h + 1 result pixels and the next 
+ tile overlaps it by w - 1 and h - 1 input pixels. 
+ The sums are computed in double and rounded: they are integers of at most KERNEL_MAX_WEIGHT * RGB_COMPONENT_COLOR 
+ in magnitude, and the rounding errors of tiles up to FFT_MAX_TILE stay orders of magnitude below 0.5, so the 
+ result is the same as the one of the direct engine.
+ */
+
+/* Smallest kernel area (w * h) filtered with the FFT, unless it splits into cheaper passes: the crossover measured 
+ with bench --kernels log-N,... --variants engine,fft (11x11 on an HD image, 1 thread), see the crossover line it 
+ prints.
+ */
+#define FFT_MIN_AREA 121
+#define FFT_MAX_TILE 128
+
+struct cpx {
+    double re, im;
+};
+
+/* The FFT filter of a kernel: tiles of n by n, with their twiddle factors and the spectrum of the kernel */
+struct fft_filter {
+    int n;
+    struct cpx *twiddles;    //n / 2: e^(-2 pi i j / n)
+    struct cpx *spectrum;    //n * n: the spectrum of the kernel divided by n * n, see fft_filter_init
+    struct cpx *scratch;     //for each band: two tiles and a column, fft_band_cpx
+};
+
+/* Return: the tile size for kernel k: a power of 2 at least 4 times the overlap, so that at least half of the tile 
+ is result pixels, and at most FFT_MAX_TILE.
+ */
+static int fft_tile_size(const struct kernel *k)
+{
+	int overlap = (k->w > k->h ? k->w : k->h) - 1, n = 16;
+	while (n < 4 * overlap && n < FFT_MAX_TILE) n *= 2;
+	return n;
+}
+
+/* Return: the number of struct cpx of the scratch of one band for tiles of n by n */
+static inline size_t fft_band_cpx(int n)
+{
+	return 2 * (size_t)n * n + n;
+}
+
+/* Return: the bytes of an FFT filter of kernel k for threads bands, see fft_filter_init */
+static size_t fft_filter_bytes(const struct kernel *k, int threads)
+{
+	size_t n = fft_tile_size(k);
+	return (n / 2 + n * n + threads * fft_band_cpx(n)) * sizeof(struct cpx);
+}
+
+/* FFT of the n samples of a in place (n a power of 2), or the inverse FFT without the division by n: iterative 
+ radix 2, after the bit reversal permutation.
+ */
+static void fft(struct cpx *a, int n, const struct cpx *twiddles, int inverse)
+{
+	for (int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1) j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			struct cpx t = a[i];
+			a[i] = a[j];
+			a[j] = t;
+		}
+	}
+	for (int len = 2; len <= n; len <<= 1) {
+		int half = len / 2, step = n / len;
+		for (int i = 0; i < n; i += len) {
+			for (int j = 0; j < half; j++) {
+				struct cpx w = twiddles[j * step];
+				if (inverse) w.im = -w.im;
+				struct cpx *u = &a[i + j], *v = &a[i + j + half];
+				double re = v->re * w.re - v->im * w.im, im = v->re * w.im + v->im * w.re;
+				v->re = u->re - re;
+				v->im = u->im - im;
+				u->re += re;
+				u->im += im;
+			}
+		}
+	}
+}
+
+/* 2D FFT of the n by n tile a in place, or its inverse (without the division by n * n), column being n samples of 
+ scratch. Only the first rows rows are transformed: the forward FFT is given a tile whose other rows are zero, 
+ and only needs their spectrum, the inverse only computes the first rows.
+ */
+static void fft_2d(struct cpx *a, int n, int rows, const struct cpx *twiddles, int inverse, struct cpx *column)
+{
+	if (!inverse) {
+		for (int y = 0; y < rows; y++) fft(a + y * n, n, twiddles, 0);
+	}
+	for (int x = 0; x < n; x++) {
+		for (int y = 0; y < n; y++) column[y] = a[y * n + x];
+		fft(column, n, twiddles, inverse);
+		for (int y = 0; y < n; y++) a[y * n + x] = column[y];
+	}
+	if (inverse) {
+		for (int y = 0; y < rows; y++) fft(a + y * n, n, twiddles, 1);
+	}
+}
+
+/* Set up the FFT filter f of kernel k in buffer (fft_filter_bytes): the twiddle factors and the 
+ spectrum of the kernel. The filter correlates (see struct kernel), i.e. convolves with the kernel flipped: 
+ the coefficient ky, kx goes to -ky, -kx modulo n, so that the result pixel of the tile pixel y, x comes out at y, x.
+ */
+static void fft_filter_init(struct fft_filter *f, const struct kernel *k, struct cpx *buffer)
+{
+	int n = fft_tile_size(k);
+	f->n = n;
+	f->twiddles = buffer;
+	f->spectrum = buffer + n / 2;
+	f->scratch = f->spectrum + n * n;
+	for (int j = 0; j < n / 2; j++) {
+		double a = -2 * M_PI * j / n;
+		f->twiddles[j] = (struct cpx){ cos(a), sin(a) };
+	}
+	memset(f->spectrum, 0, (size_t)n * n * sizeof(struct cpx));
+	for (int ky = 0; ky < k->h; ky++) {
+		for (int kx = 0; kx < k->w; kx++) {
+			f->spectrum[((n - ky) % n) * n + (n - kx) % n].re = (double)k->coeffs[ky * k->w + kx] / ((double)n * n);
+		}
+	}
+	fft_2d(f->spectrum, n, n, f->twiddles, 0, f->scratch);
+}
+
+/* Return: the sum s rounded to the nearest integer, divided by the divisor of k and clamped */
+static inline unsigned char fft_color(double s, const struct kernel *k)
+{
+	long long sum = s < 0 ? -(long long)(-s + 0.5) : (long long)(s + 0.5);
+	return clamp_color(sum / k->divisor);
+}
+
+/* Band computation of the FFT filter (see struct fft_filter): the band is covered by tiles of n by n input pixels 
+ around the n - w + 1 by n - h + 1 result pixels each yields. The red and green components are the real and imaginary 
+ parts of one tile, as the kernel is real their filters do not mix, the blue component has a tile of its own. 
+ Pixels past the edges of the image are read with the border mode, as in convolve_edge_pixel.
+ */
+void *compute_fft_threadfn(void *params)
+{
+	struct parameter* p = (struct parameter*) params;
+	const struct image *image = p->image;
+	const struct kernel *k = p->kernel;
+	const struct fft_filter *f = p->fft;
+	int n = f->n;
+	long rx = k->w / 2, ry = k->h / 2;
+	unsigned long tile_w = n - k->w + 1, tile_h = n - k->h + 1;
+	unsigned long end = p->start + p->size, x_end = image->w - p->halo;
+	struct cpx *rg = f->scratch + p->index * fft_band_cpx(n), *b = rg + n * n, *column = b + n * n;
+	for (unsigned long y0 = p->start; y0 < end; y0 += tile_h) {
+		unsigned long out_h = end - y0 < tile_h ? end - y0 : tile_h;
+		int in_h = out_h + k->h - 1;
+		for (unsigned long x0 = p->halo; x0 < x_end; x0 += tile_w) {
+			unsigned long out_w = x_end - x0 < tile_w ? x_end - x0 : tile_w;
+			int in_w = out_w + k->w - 1;
+			memset(rg, 0, 2 * (size_t)n * n * sizeof(struct cpx));
+			for (int y = 0; y < in_h; y++) {
+				long ny = border_coordinate(p->border, (long)y0 - ry + y, image->h);
+				if (ny < 0) continue;
+				const PPMPixel *row = image_row(image, ny);
+				for (int x = 0; x < in_w; x++) {
+					long nx = (long)x0 - rx + x;
+					if (nx < 0 || nx >= (long)image->w) nx = border_coordinate(p->border, nx, image->w);
+					if (nx < 0) continue;
+					rg[y * n + x] = (struct cpx){ row[nx].r, row[nx].g };
+					b[y * n + x].re = row[nx].b;
+				}
+			}
+			fft_2d(rg, n, in_h, f->twiddles, 0, column);
+			fft_2d(b, n, in_h, f->twiddles, 0, column);
+			for (int i = 0; i < n * n; i++) {
+				const struct cpx *s = &f->spectrum[i];
+				struct cpx t = rg[i], u = b[i];
+				rg[i] = (struct cpx){ t.re * s->re - t.im * s->im, t.re * s->im + t.im * s->re };
+				b[i] = (struct cpx){ u.re * s->re - u.im * s->im, u.re * s->im + u.im * s->re };
+			}
+			fft_2d(rg, n, out_h, f->twiddles, 1, column);
+			fft_2d(b, n, out_h, f->twiddles, 1, column);
+			for (unsigned long y = 0; y < out_h; y++) {
+				PPMPixel *out = image_row(p->result, y0 + y - p->halo) + x0 - p->halo;
+				for (unsigned long x = 0; x < out_w; x++) {
+					out[x].r = fft_color(rg[y * n + x].re, k);
+					out[x].g = fft_color(rg[y * n + x].im, k);
+					out[x].b = fft_color(b[y * n + x].re, k);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Canny edge detection (canny=1 or canny=low,high) instead of the kernel: the luma of the image is blurred with the 
+ 5 by 5 binomial of gauss5, its gradient taken with Sobel, and the pixels whose gradient magnitude (|gx| + |gy|, at 
+ most CANNY_MAG_MAX) is a maximum along the gradient direction are kept when it reaches high (strong edges), or when 
+ it reaches low and they are connected to a strong edge (weak edges, followed by hysteresis). 
+ The stages are fused per tile of CANNY_TILE columns of a band: each stage hands its rows to the next one through a 
+ ring of a few rows, which stays in the L1 cache, and only the class of each pixel (enum canny_class) is written, 
+ into the red component of the result. The band then follows its own edges, and canny_merge_bands follows them 
+ across the bands and writes the final image: white edges on black.
+ */
+#define CANNY_HALO 4                 //input pixels around a result pixel: 2 for the blur, 1 for Sobel, 1 for the maximum
+#define CANNY_MAG_MAX (8 * RGB_COMPONENT_COLOR)   //largest |gx| + |gy|
+#define CANNY_TILE 256
+#define CANNY_LOW 40                 //default thresholds of canny=1
+#define CANNY_HIGH 100
+#define CANNY_STACK 4096             //pixels waiting to be followed, see canny_follow
+
+enum canny_class {
+    CANNY_NONE,
+    CANNY_WEAK,                      //maximum from low, an edge if connected to a strong edge
+    CANNY_PENDING,                   //edge whose neighbours are still to be followed
+    CANNY_EDGE = RGB_COMPONENT_COLOR //edge whose neighbours have been followed
+};
+
+typedef uint16_t u16x8 __attribute__((vector_size(16)));
+
+/* Return: the 8 int16_t at p */
+static inline i16x8 canny_load(const int16_t *p)
+{
+	i16x8 v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+/* Store in out the luma (BT.601 weights, 8 bits) of the n pixels of row from x on, x being at most CANNY_HALO past 
+ the edges of the image of width w. row is NULL for a black row.
+ */
+static void canny_luma_row(const PPMPixel *row, enum border_mode mode, unsigned long w, long x, int n, int16_t *out)
+{
+	if (row && x >= 0 && x + n <= (long)w) {
+		for (int i = 0; i < n; i++) {
+			out[i] = (77 * row[x + i].r + 150 * row[x + i].g + 29 * row[x + i].b + 128) >> 8;
+		}
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		long nx = border_coordinate(mode, x + i, w);
+		out[i] = row && nx >= 0 ? (77 * row[nx].r + 150 * row[nx].g + 29 * row[nx].b + 128) >> 8 : 0;
+	}
+}
+
+/* Return: the gradient directions of gx, gy for the non-maximum suppression: 0 horizontal, 2 vertical, 1 the diagonal
+ going down to the right and 3 the other one. The boundaries are at 22.5 degrees, tan 22.5 being about 12 / 29, 
+ which keeps the products in int16_t lanes.
+ */
+static inline i16x8 canny_direction(i16x8 gx, i16x8 gy, i16x8 ax, i16x8 ay)
+{
+	i16x8 horizontal = ay * 29 <= ax * 12, vertical = ax * 29 <= ay * 12, same_sign = (gx ^ gy) >= 0;
+	i16x8 diagonal = 3 ^ (same_sign & 2);
+	return ~horizontal & ((vertical & 2) | (~vertical & diagonal));
+}
+
+/* Follow the edges of band p through its weak pixels: the pending pixels of the result rows y0 to y1 - 1 become 
+ edges, and so do the weak pixels connected to them within the band. The pixels waiting to be followed go on a stack 
+ of CANNY_STACK pixels; those that do not fit stay pending, and the whole band is scanned again for them.
+ */
+static void canny_follow(const struct parameter *p, unsigned long y0, unsigned long y1)
+{
+	const struct image *result = p->result;
+	unsigned long first = p->start - p->halo, last = first + p->size - 1;   // rows of the band
+	unsigned long stack[CANNY_STACK][2];
+	int overflow;
+	do {
+		overflow = 0;
+		for (unsigned long y = y0; y < y1; y++) {
+			PPMPixel *row = image_row(result, y);
+			for (unsigned long x = 0; x < result->w; x++) {
+				if (row[x].r != CANNY_PENDING) continue;
+				row[x].r = CANNY_EDGE;
+				int top = 0;
+				stack[top][0] = x;
+				stack[top++][1] = y;
+				while (top > 0) {
+					top--;
+					unsigned long cx = stack[top][0], cy = stack[top][1];
+					for (unsigned long ny = cy > first ? cy - 1 : cy; ny <= cy + 1 && ny <= last; ny++) {
+						PPMPixel *next = image_row(result, ny);
+						for (unsigned long nx = cx > 0 ? cx - 1 : cx; nx <= cx + 1 && nx < result->w; nx++) {
+							if (next[nx].r != CANNY_WEAK) continue;
+							if (top == CANNY_STACK) {
+								next[nx].r = CANNY_PENDING;
+								overflow = 1;
+								continue;
+							}
+							next[nx].r = CANNY_EDGE;
+							stack[top][0] = nx;
+							stack[top++][1] = ny;
+						}
+					}
+				}
+			}
+		}
+		// the pixels left pending can be anywhere in the band
+		y0 = first;
+		y1 = last + 1;
+	} while (overflow);
+}
+
+/* Band computation of Canny: classify the pixels of band p (see enum canny_class), then follow its edges.
+ Row iy of the input goes through the stages in turn: its luma blurred horizontally, the vertical blur of row iy - 2, 
+ the gradient of row iy - 3, and the non-maximum suppression of row iy - 4, so that each ring holds the rows the 
+ next stage needs. The stages but the luma compute 8 pixels at a time in int16_t lanes (the blur sums in uint16_t).
+ */
+void *compute_canny_threadfn(void *params)
+{
+	struct parameter* p = (struct parameter*) params;
+	const struct image *image = p->image;
+	long start = p->start, end = p->start + p->size;
+	unsigned long x_end = image->w - p->halo;
+	// the rows are padded to whole vectors, the lanes past the tile are computed and never used
+	int16_t luma[CANNY_TILE + 2 * CANNY_HALO + 8] = {0};
+	int16_t hsum[5][CANNY_TILE + 4 + 8] = {{0}};   //columns x0 - 2 to x1 + 1, row iy in slot (iy - start + 4) % 5
+	int16_t blur[3][CANNY_TILE + 4 + 8] = {{0}};   //columns x0 - 2 to x1 + 1, row y in slot (y - start + 2) % 3
+	int16_t mag[3][CANNY_TILE + 2 + 8] = {{0}};    //columns x0 - 1 to x1, row y in slot (y - start + 1) % 3
+	int16_t dir[3][CANNY_TILE + 2 + 8] = {{0}};
+	unsigned char classes[CANNY_TILE + 8];
+	const i16x8 zero = {0};
+	// thresholds past the largest magnitude keep no edge
+	const i16x8 low = zero + (int16_t)(p->canny_low > CANNY_MAG_MAX ? CANNY_MAG_MAX + 1 : p->canny_low);
+	const i16x8 high = zero + (int16_t)(p->canny_high > CANNY_MAG_MAX ? CANNY_MAG_MAX + 1 : p->canny_high);
+	for (unsigned long x0 = p->halo; x0 < x_end; x0 += CANNY_TILE) {
+		int n = x_end - x0 > CANNY_TILE ? CANNY_TILE : x_end - x0;
+		for (long iy = start - CANNY_HALO; iy < end + CANNY_HALO; iy++) {
+			long ny = border_coordinate(p->border, iy, image->h);
+			canny_luma_row(ny < 0 ? NULL : image_row(image, ny), p->border, image->w, x0 - CANNY_HALO, n + 2 * CANNY_HALO, luma);
+			int16_t *h = hsum[(iy - start + 4) % 5];
+			for (int i = 0; i < n + 4; i += 8) {
+				i16x8 v = canny_load(luma + i) + 4 * canny_load(luma + i + 1) + 6 * canny_load(luma + i + 2) 
+				          + 4 * canny_load(luma + i + 3) + canny_load(luma + i + 4);
+				memcpy(h + i, &v, sizeof v);
+			}
+			if (iy < start) continue;
+			long by = iy - 2;
+			const int16_t *h0 = hsum[(by - start + 2) % 5], *h1 = hsum[(by - start + 3) % 5], *h2 = hsum[(by - start + 4) % 5], 
+			              *h3 = hsum[(by - start + 5) % 5], *h4 = hsum[(by - start + 6) % 5];
+			int16_t *b = blur[(by - start + 2) % 3];
+			for (int i = 0; i < n + 4; i += 8) {
+				// up to 256 * 255 + 128: uint16_t
+				u16x8 sum = (u16x8)canny_load(h0 + i) + 4 * (u16x8)canny_load(h1 + i) + 6 * (u16x8)canny_load(h2 + i) 
+				            + 4 * (u16x8)canny_load(h3 + i) + (u16x8)canny_load(h4 + i) + 128;
+				i16x8 v = (i16x8)(sum >> 8);
+				memcpy(b + i, &v, sizeof v);
+			}
+			if (iy < start + 2) continue;
+			long my = iy - 3;
+			const int16_t *b0 = blur[(my - start + 1) % 3], *b1 = blur[(my - start + 2) % 3], *b2 = blur[(my - start + 3) % 3];
+			int16_t *m = mag[(my - start + 1) % 3], *d = dir[(my - start + 1) % 3];
+			for (int i = 0; i < n + 2; i += 8) {
+				i16x8 left = canny_load(b0 + i) + 2 * canny_load(b1 + i) + canny_load(b2 + i);
+				i16x8 right = canny_load(b0 + i + 2) + 2 * canny_load(b1 + i + 2) + canny_load(b2 + i + 2);
+				i16x8 top = canny_load(b0 + i) + 2 * canny_load(b0 + i + 1) + canny_load(b0 + i + 2);
+				i16x8 bottom = canny_load(b2 + i) + 2 * canny_load(b2 + i + 1) + canny_load(b2 + i + 2);
+				i16x8 gx = right - left, gy = bottom - top;
+				i16x8 ax = (gx ^ (gx >> 15)) - (gx >> 15), ay = (gy ^ (gy >> 15)) - (gy >> 15);
+				i16x8 v = ax + ay, code = canny_direction(gx, gy, ax, ay);
+				memcpy(m + i, &v, sizeof v);
+				memcpy(d + i, &code, sizeof code);
+			}
+			if (iy < start + 4) continue;
+			long y = iy - 4;
+			const int16_t *up = mag[(y - start) % 3], *mid = mag[(y - start + 1) % 3], *down = mag[(y - start + 2) % 3];
+			const int16_t *dmid = dir[(y - start + 1) % 3];
+			for (int i = 0; i < n; i += 8) {
+				// the neighbours along the gradient of the magnitude v of the pixels x0 + i to x0 + i + 7
+				i16x8 code = canny_load(dmid + i + 1), v = canny_load(mid + i + 1);
+				i16x8 e0 = code == 0, e1 = code == 1, e2 = code == 2, e3 = code == 3;
+				i16x8 a = (e0 & canny_load(mid + i)) | (e1 & canny_load(up + i)) | (e2 & canny_load(up + i + 1)) 
+				          | (e3 & canny_load(up + i + 2));
+				i16x8 c = (e0 & canny_load(mid + i + 2)) | (e1 & canny_load(down + i + 2)) | (e2 & canny_load(down + i + 1)) 
+				          | (e3 & canny_load(down + i));
+				i16x8 keep = (v >= low) & (v > a) & (v >= c), strong = v >= high;
+				i16x8 class = keep & ((strong & CANNY_PENDING) | (~strong & CANNY_WEAK));
+				u8x8 bytes = __builtin_convertvector(class, u8x8);
+				memcpy(classes + i, &bytes, sizeof bytes);
+			}
+			PPMPixel *out = image_row(p->result, y - p->halo) + x0 - p->halo;
+			for (int i = 0; i < n; i++) out[i].r = classes[i];
+		}
+	}
+	canny_follow(p, start - p->halo, end - p->halo);
+	return NULL;
+}
+
+/* Band computation of the hysteresis rounds of canny_merge_bands: follow the edges of band p from the pixels of its 
+ first and last rows that became pending.
+ */
+void *canny_follow_threadfn(void *params)
+{
+	struct parameter* p = (struct parameter*) params;
+	unsigned long first = p->start - p->halo, last = first + p->size - 1;
+	if (!p->canny_seeded) return NULL;
+	canny_follow(p, first, first + 1);
+	canny_follow(p, last, last + 1);
+	return NULL;
+}
+
+/* Band computation of the end of Canny: write the edges of band p white and the other pixels black. */
+void *canny_finish_threadfn(void *params)
+{
+	struct parameter* p = (struct parameter*) params;
+	for (unsigned long y = p->start - p->halo; y < p->start - p->halo + p->size; y++) {
+		PPMPixel *row = image_row(p->result, y);
+		for (unsigned long x = 0; x < p->result->w; x++) {
+			unsigned char v = row[x].r == CANNY_EDGE ? RGB_COMPONENT_COLOR : 0;
+			row[x] = (PPMPixel){ v, v, v };
+		}
+		band_row_done(p, row);
+	}
+	return NULL;
+}
+
+/* An implementation of the band computation. All variants produce the same result and only differ in speed,
+ so they can be compared with the bench subcommand and chosen per job with variant=name.
+ */
+typedef void *(*band_compute_fn)(void *params);
+
+struct filter_variant {
+    const char *name;
+    band_compute_fn band_fn;
+    int any_kernel;              //runs every kernel, else only the Laplacian (see filter_bands)
+};
+
+/* The first variant is the default */
+static const struct filter_variant filter_variants[] = {
+	{"split",     &compute_laplacian_split_threadfn, 0},
+	{"reference", &compute_laplacian_threadfn,       0},
+	{"engine",    &compute_convolution_threadfn,     1},
+	{"passes",    &compute_passes_threadfn,          1},
+	{"fft",       &compute_fft_threadfn,             1},
+};
+
+#define NUM_FILTER_VARIANTS (int)(sizeof filter_variants / sizeof filter_variants[0])
+
+/* Return: index in filter_variants of the variant called name, or -1 if there is none. */
+int find_filter_variant(const char *name)
+{
+	for (int i = 0; i < NUM_FILTER_VARIANTS; i++) {
+		if (strcmp(filter_variants[i].name, name) == 0) return i;
+	}
+	return -1;
+}
+
+/* Band pool thread function. Compute bands taken from the pool queue until the pool is shut down, 
+ and wake up the submitter of a batch when its last band is done.
+ */
+void *band_pool_threadfn(void *args)
+{
+	struct band_pool *pool = (struct band_pool*) args;
+	trace_set_thread_name("band");
+	pthread_mutex_lock(&pool->mtx);
+	for (;;) {
+		while (!pool->head && !pool->shutdown) {
+			pthread_cond_wait(&pool->work, &pool->mtx);
+		}
+		if (!pool->head) break;
+		struct parameter *p = pool->head;
+		pool->head = p->next;
+		if (!pool->head) pool->tail = NULL;
+		pthread_mutex_unlock(&pool->mtx);
+
+		struct perf_counts counts;
+		int counting = perf_begin(&counts) == 0;
+		double trace_start = trace_begin();
+		p->band_fn(p);
+		if (trace_enabled) trace_record("band", trace_start, p->image_id, p->index, NULL);
+		if (counting) perf_end(&counts, PERF_FILTER, (unsigned long long)p->size * p->result->w);
+
+		pthread_mutex_lock(&pool->mtx);
+		if (--p->batch->remaining == 0) {
+			pthread_cond_signal(&p->batch->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->mtx);
+	perf_thread_close();
+	return NULL;
+}
+
+/* Start num_threads band threads.
+ Return: 0 on success, -1 on failure.
+ */
+int band_pool_start(struct band_pool *pool, int num_threads)
+{
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->shutdown = 0;
+	pool->num_threads = 0;
+	pthread_mutex_init(&pool->mtx, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pool->threads = malloc(num_threads * sizeof(pthread_t));
+	if (!pool->threads) {
+		perror("malloc");
+		return -1;
+	}
+	for (int i = 0; i < num_threads; i++) {
+		int err = pthread_create(&pool->threads[i], NULL, &band_pool_threadfn, (void*)pool);
+		if (err) {
+			fprintf(stderr, "pthread_create failure: %s\n", strerror(err));
+			return -1;
+		}
+		pool->num_threads++;
+	}
+	return 0;
+}
+
+/* Let the band threads finish the queued bands, then join them.
+ */
+void band_pool_stop(struct band_pool *pool)
+{
+	pthread_mutex_lock(&pool->mtx);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mtx);
+	for (int i = 0; i < pool->num_threads; i++) {
+		int err = pthread_join(pool->threads[i], NULL);
+		if (err) 
+			fprintf(stderr, "pthread_join error: %s", strerror(err));
+	}
+	free(pool->threads);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->mtx);
+}
+
+/* Queue the count bands in params on the band pool and wait until all of them are computed.
+ */
+void band_pool_run(struct band_pool *pool, struct parameter *params, int count)
+{
+	struct band_batch batch;
+	batch.remaining = count;
+	pthread_cond_init(&batch.done, NULL);
+	pthread_mutex_lock(&pool->mtx);
+	for (int i = 0; i < count; i++) {
+		params[i].batch = &batch;
+		params[i].next = NULL;
+		if (pool->tail) {
+			pool->tail->next = &params[i];
+		} else {
+			pool->head = &params[i];
+		}
+		pool->tail = &params[i];
+	}
+	pthread_cond_broadcast(&pool->work);
+	while (batch.remaining > 0) {
+		pthread_cond_wait(&batch.done, &pool->mtx);
+	}
+	pthread_mutex_unlock(&pool->mtx);
+	pthread_cond_destroy(&batch.done);
+}
+
+/* Return: the width of the border of input pixels around the image filtered with options opts: the kernel radius 
+ (CANNY_HALO for Canny) for a region of interest (filled in by read_region), else 0.
+ */
+static inline unsigned long filter_halo(const struct job_options *opts)
+{
+	if (!opts->has_roi) return 0;
+	return opts->canny ? CANNY_HALO : kernel_radius(&opts->kernel);
+}
+
+/* Return: whether a job with options opts filters in place: with inplace=1, except for Canny, whose tiles read the 
+ input columns around them after the tile before has written its result.
+ */
+static inline int filter_inplace(const struct job_options *opts)
+{
+	return opts->inplace && !opts->canny;
+}
+
+/* Return: the band computation of filter_bands for options opts, with the kernel split into passes when it splits.
+ The band computation is the one of opts->variant. The other kernels than the Laplacian run the variants that are not
+ only for it (engine, passes and fft), else the two passes when their kernel splits into cheaper terms (see 
+ passes_cheaper), the FFT from FFT_MIN_AREA coefficients, and the engine for the rest. passes falls back to the engine 
+ for a kernel that does not split, and in-place filtering always runs the engine. Canny runs compute_canny_threadfn
+ whatever the variant.
+ */
+static band_compute_fn select_band_fn(const struct job_options *opts, struct kernel_passes *passes)
+{
+	const struct kernel *kernel = &opts->kernel;
+	const struct filter_variant *variant = &filter_variants[opts->variant];
+	int split = split_kernel(kernel, passes) == 0;
+	if (opts->canny) return &compute_canny_threadfn;
+	if (filter_inplace(opts)) return &compute_convolution_inplace_threadfn;
+	if (!variant->any_kernel && !kernel_equal(kernel, &laplacian8_kernel)) {
+		if (split && passes_cheaper(kernel, passes)) return &compute_passes_threadfn;
+		return kernel->w * kernel->h >= FFT_MIN_AREA ? &compute_fft_threadfn : &compute_convolution_threadfn;
+	}
+	if (variant->band_fn == &compute_passes_threadfn && !split) return &compute_convolution_threadfn;
+	return variant->band_fn;
+}
+
+/* Return: the bytes of the scratch buffers of filter_bands for options opts and threads bands, besides the in-place 
+ history: the FFT filter when it runs, see fft_filter_bytes.
+ */
+static size_t filter_scratch_bytes(const struct job_options *opts, int threads)
+{
+	struct kernel_passes passes;
+	return select_band_fn(opts, &passes) == &compute_fft_threadfn ? fft_filter_bytes(&opts->kernel, threads) : 0;
+}
+
+/* Mark pending the weak pixels of row next that touch an edge of row edges (the rows on either side of the boundary 
+ of two bands), in result w pixels wide.
+ Return: 1 if a pixel was marked, else 0.
+ */
+static int canny_seed_row(const PPMPixel *edges, PPMPixel *next, unsigned long w)
+{
+	int seeded = 0;
+	for (unsigned long x = 0; x < w; x++) {
+		if (edges[x].r != CANNY_EDGE) continue;
+		for (unsigned long nx = x > 0 ? x - 1 : x; nx <= x + 1 && nx < w; nx++) {
+			if (next[nx].r == CANNY_WEAK) {
+				next[nx].r = CANNY_PENDING;
+				seeded = 1;
+			}
+		}
+	}
+	return seeded;
+}
+
+/* Finish Canny once each of the count bands of params has followed its own edges (see compute_canny_threadfn): follow
+ the edges across the band boundaries, in rounds. Between the rounds the weak pixels of the first and last rows of 
+ each band that touch an edge of the neighbouring band become pending (a pass over two rows per boundary), then the 
+ bands that got some follow them in parallel. No round follows a pixel twice, and the rounds stop when no edge 
+ reaches a weak pixel across a boundary any more. Then the bands write the final image.
+ */
+static void canny_merge_bands(struct parameter *params, int count)
+{
+	const struct image *result = params[0].result;
+	int seeded;
+	do {
+		seeded = 0;
+		for (int i = 0; i < count; i++) params[i].canny_seeded = 0;
+		for (int i = 0; i + 1 < count; i++) {
+			unsigned long boundary = params[i + 1].start - params[i + 1].halo;   // first row of band i + 1
+			PPMPixel *above = image_row(result, boundary - 1), *below = image_row(result, boundary);
+			if (canny_seed_row(above, below, result->w)) params[i + 1].canny_seeded = seeded = 1;
+			if (canny_seed_row(below, above, result->w)) params[i].canny_seeded = seeded = 1;
+		}
+		if (seeded) {
+			for (int i = 0; i < count; i++) params[i].band_fn = &canny_follow_threadfn;
+			band_pool_run(&band_pool, params, count);
+		}
+	} while (seeded);
+	for (int i = 0; i < count; i++) params[i].band_fn = &canny_finish_threadfn;
+	band_pool_run(&band_pool, params, count);
+}
+
+/* Return: whether band_fn packs the rows it computes into bits itself with threshold=N, see band_row_done (Canny in 
+ canny_finish_threadfn). 
+ */
+static int threshold_fused(band_compute_fn band_fn)
+{
+	return band_fn == &compute_laplacian_split_threadfn || band_fn == &compute_convolution_threadfn || 
+	       band_fn == &compute_canny_threadfn;
+}
+
+/* Filter image into result using the band pool threads, with the band computation of select_band_fn. 
+ When opts->has_roi is set image is a region with a border of filter_halo pixels (filled in by read_region), 
+ and result is only the region, else result is the size of image.
+ The image is split in opts->threads bands. Each band shall be an equal share of the work, i.e. work=height/number of bands. 
+ If the size is not even, the last band shall take the rest of the work.
+ With opts->threshold the rows of result are packed into bits (result->bits).
+ Return: 0 on success, -1 on failure.
+ */
+int filter_bands(const struct image *image, struct image *result, const struct job_options *opts)
+{
+	unsigned long halo = filter_halo(opts);
+	unsigned long rows = image->h - 2 * halo;
+	int num_threads = (rows / opts->threads) < 1 ? rows : opts->threads; // cap number of threads to the height of the image - prevents threads from doing zero work
+	struct parameter* params = (struct parameter*) mem_malloc(num_threads * sizeof(struct parameter));
+	if (!params) {
+		perror("malloc");
+		return -1;
+	}
+	const struct kernel *kernel = &opts->kernel;
+	PPMPixel *history = NULL;
+	if (filter_inplace(opts)) {
+		history = mem_malloc(inplace_history_bytes(image->w, kernel, num_threads));
+		if (!history) {
+			perror("malloc");
+			mem_free(params);
+			return -1;
+		}
+	}
+	struct kernel_passes passes;
+	band_compute_fn band_fn = select_band_fn(opts, &passes);
+	struct fft_filter fft;
+	struct cpx *fft_buffer = NULL;
+	if (band_fn == &compute_fft_threadfn) {
+		fft_buffer = mem_malloc(fft_filter_bytes(kernel, num_threads));
+		if (!fft_buffer) {
+			perror("malloc");
+			mem_free(params);
+			return -1;
+		}
+		fft_filter_init(&fft, kernel, fft_buffer);
+	}
+	kernel_row_fn row_fn = find_row_fn(kernel);
+	int threshold = threshold_fused(band_fn) ? opts->threshold : 0;
+	
+	// Split image processing between evenly between threads. 
+	// Last thread takes care of what's left, in case of an odd number of lines to process.
+	int i;
+    for (i = 0; i < num_threads - 1; i++) {
+		params[i].image = image;
+		params[i].result = result;
+		params[i].halo = halo;
+		params[i].band_fn = band_fn;
+		params[i].border = opts->border;
+		params[i].kernel = kernel;
+		params[i].row_fn = row_fn;
+		params[i].passes = &passes;
+		params[i].fft = &fft;
+		params[i].canny_low = opts->canny_low;
+		params[i].canny_high = opts->canny_high;
+		params[i].threshold = threshold;
+		params[i].image_id = trace_image;
+		params[i].index = i;
+		params[i].size = rows/num_threads;
+		params[i].start = halo + i * params[i].size;
+	}   
+	params[i].image = image;
+	params[i].result = result;
+	params[i].halo = halo;
+	params[i].band_fn = band_fn;
+	params[i].border = opts->border;
+	params[i].kernel = kernel;
+	params[i].row_fn = row_fn;
+	params[i].passes = &passes;
+	params[i].fft = &fft;
+	params[i].canny_low = opts->canny_low;
+	params[i].canny_high = opts->canny_high;
+	params[i].threshold = threshold;
+	params[i].image_id = trace_image;
+	params[i].index = i;
+	params[i].start = halo + i * (rows/num_threads);
+	params[i].size = image->h - halo - params[i].start;
+	if (history) {
+		// the rows around each band, before any band overwrites them
+		unsigned long ry = kernel->h / 2;
+		for (i = 0; i < num_threads; i++) {
+			struct parameter *p = &params[i];
+			p->history = (PPMPixel*)((unsigned char*)history + (size_t)i * kernel->h * image->stride);
+			for (unsigned long j = 0; j < ry; j++) {
+				long above = (long)p->start - (long)ry + j;
+				copy_border_row(image, opts->border, above, history_row(p, history_slot(p, above)));
+				copy_border_row(image, opts->border, p->start + p->size + j, history_row(p, ry + 1 + j));
+			}
+		}
+	}
+	double trace_start = trace_begin();
+	band_pool_run(&band_pool, params, num_threads);
+	if (band_fn == &compute_canny_threadfn) canny_merge_bands(params, num_threads);
+	if (opts->threshold && !threshold) {
+		for (i = 0; i < num_threads; i++) {
+			params[i].band_fn = &compute_threshold_threadfn;
+			params[i].threshold = opts->threshold;
+		}
+		band_pool_run(&band_pool, params, num_threads);
+	}
+	result->bits = opts->threshold != 0;
+	if (trace_enabled) trace_record("join", trace_start, trace_image, -1, NULL);
+	mem_free(fft_buffer);
+	mem_free(history);
+	mem_free(params);
+	return 0;
+}
+
+/* Apply the filter kernel of opts to an image using the band pool threads (see filter_bands).
+ For a job with a region of interest, image is the region with a border of filter_halo pixels, and the result is 
+ only the region.
+ When filtering in place (see filter_inplace) the result is written over image, and takes over its buffer: image no 
+ longer owns it.
+ Compute the elapsed time and store it in *elapsedTime (CLOCK_MONOTONIC,
+ which unlike gettimeofday does not jump when the system clock is adjusted).
+ Return: 0 on success, with the filtered image in result, -1 on failure. The caller is responsible for freeing result.
+ */
+int apply_filters(struct image *image, struct image *result, const struct job_options *opts, double *elapsedTime) {
+	// start elapsed time
+	double start_time = now_seconds();
+
+	unsigned long halo = filter_halo(opts);
+	int inplace = filter_inplace(opts);
+	if (inplace) {
+		*result = *image;
+		result->pixels = image_row(image, halo) + halo;
+		result->w -= 2 * halo;
+		result->h -= 2 * halo;
+		result->buffer = NULL;
+	} else if (image_alloc(result, image->w - 2 * halo, image->h - 2 * halo, 0)) {
+		return -1;
+	}
+	if (filter_bands(image, result, opts)) {
+		image_free(result);
+		return -1;
+	}
+	if (inplace) {
+		result->buffer = image->buffer;
+		image->buffer = NULL;
+	}
+
+	// end elapsed time
+	*elapsedTime = now_seconds() - start_time;
+    return 0;
+}
+
+/* Create the missing parent directories of path, like mkdir -p on its dirname.
+ Return: 0 on success, -1 on failure.
+ */
+static int make_parent_dirs(const char *path)
+{
+	char *dir = strdup(path);
+	if (!dir) {
+		perror("strdup");
+		return -1;
+	}
+	int status = 0;
+	for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(dir, 0777) && errno != EEXIST) {
+			fprintf(stderr, "\"%s\": cannot create directory: %s\n", dir, strerror(errno));
+			status = -1;
+			break;
+		}
+		*slash = '/';
+	}
+	free(dir);
+	return status;
+}
+
+/* Write the P6 header of a width by height image to outfile */
+static void write_header(FILE *outfile, unsigned long int width, unsigned long int height, int bits)
+{
+	fprintf(outfile, bits ? "P4\n" : "P6\n");
+	fprintf(outfile, "# Cameron Henderson Western Washington University CSCI347\n");
+	fprintf(outfile, "%lu ", width);
+	fprintf(outfile, "%lu\n", height);
+	if (!bits) fprintf(outfile, "%d\n", RGB_COMPONENT_COLOR);
+}
+
+/* Return: the bytes of a row of img in its file: packed pixels, or packed bits for a bit image */
+static inline size_t file_row_bytes(const struct image *img)
+{
+	return img->bits ? (img->w + 7) / 8 : img->w * sizeof(PPMPixel);
+}
+
+/* Write the rows of img to fd as packed PPM pixel data (PBM bits for a bit image), at offset, or at the current position 
+ of fd when offset is -1.
+ The padding at the end of the rows is left out by the iovecs of pwritev (writev), so there is no packing copy:
+ the rows go straight from img to the kernel, WRITE_IOVECS at a time.
+ Return: 0 on success, -1 on failure.
+ */
+static int write_rows(int fd, off_t offset, const struct image *img)
+{
+	size_t row_bytes = file_row_bytes(img);
+	struct iovec iov[WRITE_IOVECS];
+	unsigned long y = 0;
+	size_t done = 0;  // bytes of row y already written
+	while (y < img->h) {
+		int count = 0;
+		for (unsigned long r = y; r < img->h && count < WRITE_IOVECS; r++, count++) {
+			size_t skip = r == y ? done : 0;
+			iov[count].iov_base = (unsigned char*)image_row(img, r) + skip;
+			iov[count].iov_len = row_bytes - skip;
+		}
+		ssize_t n = offset < 0 ? writev(fd, iov, count) : pwritev(fd, iov, count, offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		if (offset >= 0) offset += n;
+		y += (done + n) / row_bytes;
+		done = (done + n) % row_bytes;
+	}
+	return 0;
+}
+
+/*Create a new P6 file (P4 for a bit image) to save the filtered image in. Write the header block
+ e.g. P6
+      Width Height
+      Max color value
+ (no max color value for P4) then write the image data (see write_rows).
+ The name of the new file shall be "filename" (the second argument). Missing directories in filename are created.
+ Return: 0 on success, -1 on failure.
+ */
+int write_image(const struct image *image, char *filename)
+{
+	FILE* outfile;
+	if (make_parent_dirs(filename)) {
+		return -1;
+	}
+	outfile = fopen(filename, "w");
+	if (outfile == NULL) {
+		fprintf(stderr, "\"%s\": write file error: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	
+	write_header(outfile, image->w, image->h, image->bits);
+
+	int status = 0;
+	if (fflush(outfile) || write_rows(fileno(outfile), -1, image)) {
+		fprintf(stderr, "error writing to destination file \"%s\"\n", filename);
+		status = -1;
+	}
+	if (fclose(outfile)) {
+		fprintf(stderr, "\"%s\": write file error: %s\n", filename, strerror(errno));
+		status = -1;
+	}
+	return status;
+}
+
+/* Copy data from the stream into buffer 'buf' until whitespace is reached. 
+ * A terminating null character is appended to the end of the characters in buf.
+ * Whitespace and any lines starting with # symbol before the data will be skipped.
+ * Only the single whitespace character that ends the data is consumed, since the pixel data starts 
+ * right after the whitespace following the max color value, and may itself start with whitespace bytes.
+ * Return: number of characters written into buf, excluding the terminating null.
+ */
+static int getnextchunk(FILE* file, char* buf, int bufsiz) {
+	int c = fgetc(file);
+	for (;;) {
+		if ( c == '#' ) {
+			while ( c != '\n' && c != EOF ) { 
+				c = fgetc(file);
+			}
+		} else if ( !isspace(c) ) {
+			break;
+		}
+		c = fgetc(file);
+	}
+	if ( c == EOF) {
+		buf[0] = '\0';
+		return 0; 
+	}
+	int i = 0; 
+	while ( !isspace(c) && c != EOF && i < bufsiz - 1) {
+		buf[i] = c;
+		c = fgetc(file);
+		i++;
+	}
+	buf[i] = '\0';
+	if ( !isspace(c) && c != EOF ) {
+		ungetc(c, file);
+	}
+	return i;
+}
+
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxh64_reset(struct xxh64_state *state, uint64_t seed)
+{
+	memset(state, 0, sizeof *state);
+	state->seed = seed;
+	state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	state->v[1] = seed + XXH_PRIME64_2;
+	state->v[2] = seed;
+	state->v[3] = seed - XXH_PRIME64_1;
+}
+
+/* Feed len bytes to the hash. XXH64 (https://github.com/Cyan4973/xxHash) consumes 32-byte stripes at 
+ several GB/s, so hashing the pixels as they are read costs much less than reading them.
+ */
+void xxh64_update(struct xxh64_state *state, const void *input, size_t len)
+{
+	const unsigned char *p = input;
+	const unsigned char *end = p + len;
+	state->total_len += len;
+	if (state->memsize + len < 32) {
+		memcpy(state->mem + state->memsize, p, len);
+		state->memsize += len;
+		return;
+	}
+	if (state->memsize) {
+		memcpy(state->mem + state->memsize, p, 32 - state->memsize);
+		p += 32 - state->memsize;
+		for (int i = 0; i < 4; i++) {
+			state->v[i] = xxh64_round(state->v[i], read64(state->mem + 8 * i));
+		}
+		state->memsize = 0;
+	}
+	uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+	while (p + 32 <= end) {
+		v0 = xxh64_round(v0, read64(p));
+		v1 = xxh64_round(v1, read64(p + 8));
+		v2 = xxh64_round(v2, read64(p + 16));
+		v3 = xxh64_round(v3, read64(p + 24));
+		p += 32;
+	}
+	state->v[0] = v0; state->v[1] = v1; state->v[2] = v2; state->v[3] = v3;
+	memcpy(state->mem, p, end - p);
+	state->memsize = end - p;
+}
+
+uint64_t xxh64_digest(const struct xxh64_state *state)
+{
+	uint64_t h;
+	if (state->total_len >= 32) {
+		h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+		for (int i = 0; i < 4; i++) {
+			h = xxh64_merge_round(h, state->v[i]);
+		}
+	} else {
+		h = state->seed + XXH_PRIME64_5;
+	}
+	h += state->total_len;
+	const unsigned char *p = state->mem;
+	const unsigned char *end = p + state->memsize;
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		uint32_t k;
+		memcpy(&k, p, sizeof k);
+		h ^= (uint64_t)k * XXH_PRIME64_1;
+		h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = rotl64(h, 11) * XXH_PRIME64_1;
+	}
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* Read the width * height pixels of the image from infile, which is positioned at the start of the pixel data, into img.
+ The packed rows of the file are read one by one to their padded place in img (see struct image).
+ The size of a regular file has been checked by read_header; if a stream (eg. a pipe) ends early, the missing pixels
+ are black. If hash is not NULL, the pixel data is fed to it as each row arrives.
+ Return: 0 on success, -1 on failure. The caller is responsible for freeing img.
+ */
+static int read_pixels(FILE *infile, const char *filename, unsigned long int width, unsigned long int height, struct image *img, 
+                       struct xxh64_state *hash)
+{
+	if (image_alloc(img, width, height, 0)) {
+		return -1;
+	}
+	size_t row_bytes = width * sizeof(PPMPixel);
+	unsigned long y;
+	size_t n = row_bytes;
+	for (y = 0; y < height && n == row_bytes; y++) {
+		unsigned char *row = (unsigned char*)image_row(img, y);
+		n = fread(row, 1, row_bytes, infile);
+		if (hash) xxh64_update(hash, row, n);
+		if (n < row_bytes) {
+			memset(row + n, 0, row_bytes - n);
+		}
+	}
+	if (n < row_bytes && !feof(infile)) {
+		size_t total_pixels_read = ((y - 1) * row_bytes + n) / sizeof(PPMPixel);
+		fprintf(stderr, "\"%s\": input image read error: expected pixels: %zu, pixels read: %zu\n", filename, 
+		        (size_t)width * height, total_pixels_read);
+		image_free(img);
+		return -1;
+	}
+	for (; y < height; y++) {
+		memset(image_row(img, y), 0, row_bytes);
+	}
+    return 0;
+}
+
+/* Where copy_region takes pixels from: the file fd, whose pixel data starts at data_offset, 
+ or when fd is -1, the image pixels already in memory.
+ */
+struct pixel_source {
+    int fd;
+    off_t data_offset;
+    const struct image *image;
+    unsigned long int w;     //width of the source image
+};
+
+/* Copy count pixels of row y, starting at column x, from src to dst. Pixels past the end of a short file are left as they are.
+ Return: 0 on success, -1 on a read error.
+ */
+static int fetch_pixels(const struct pixel_source *src, unsigned long y, unsigned long x, unsigned long count, PPMPixel *dst)
+{
+	size_t len = count * sizeof(PPMPixel);
+	if (src->fd < 0) {
+		memcpy(dst, image_row(src->image, y) + x, len);
+		return 0;
+	}
+	size_t offset = (y * src->w + x) * sizeof(PPMPixel);
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pread(src->fd, (unsigned char*)dst + done, len - done, src->data_offset + offset + done);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0) break;
+		done += n;
+	}
+	return 0;
+}
+
+/* Copy the region roi of the w by h image src into dst, along with a border of halo pixels around it, 
+ so dst is roi->w + 2 * halo by roi->h + 2 * halo pixels. Where the border is past the edges of the image, it is filled in
+ with border mode border, the same way the filter does for a whole image (dst is expected to be zeroed for BORDER_ZERO).
+ Return: 0 on success, -1 on a read error.
+ */
+static int copy_region(const struct pixel_source *src, unsigned long w, unsigned long h, const struct region *roi, 
+                       unsigned long halo, enum border_mode border, const struct image *dst)
+{
+	unsigned long dst_w = roi->w + 2 * halo;
+	for (unsigned long r = 0; r < roi->h + 2 * halo; r++) {
+		long y = border_coordinate(border, (long)(roi->y + r) - (long)halo, h);
+		if (y < 0) continue;
+		PPMPixel *row = image_row(dst, r);
+		if (roi->x >= halo && roi->x + roi->w + halo <= w) {
+			// the border columns are next to the region in the file, read them together
+			if (fetch_pixels(src, y, roi->x - halo, dst_w, row)) return -1;
+			continue;
+		}
+		if (fetch_pixels(src, y, roi->x, roi->w, row + halo)) return -1;
+		for (unsigned long i = 0; i < halo; i++) {
+			long left = border_coordinate(border, (long)roi->x - (long)halo + (long)i, w);
+			long right = border_coordinate(border, roi->x + roi->w + i, w);
+			if ((left >= 0 && fetch_pixels(src, y, left, 1, row + i)) ||
+			    (right >= 0 && fetch_pixels(src, y, right, 1, row + halo + roi->w + i))) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Read the region roi of the width by height image in infile, positioned at the start of the pixel data,
+ with a border of halo pixels (see copy_region). When infile is a regular file, only the rows that are needed are read,
+ with pread; otherwise the whole image is read first. 
+ If hash is not NULL, the region is fed to it.
+ Return: 0 on success, -1 on failure. The caller is responsible for freeing region.
+ */
+static int read_region(FILE *infile, const char *filename, unsigned long int w, unsigned long int h, const struct region *roi, 
+                       unsigned long halo, enum border_mode border, struct image *region, struct xxh64_state *hash)
+{
+	if (roi->w > w || roi->x > w - roi->w || roi->h > h || roi->y > h - roi->h) {
+		fprintf(stderr, "\"%s\": region %lu,%lu,%lu,%lu is outside the %lux%lu image\n", filename, roi->x, roi->y, roi->w, roi->h, w, h);
+		return -1;
+	}
+	// copy_region fills in every pixel but the border past the edges of the image with BORDER_ZERO
+	if (image_alloc(region, roi->w + 2 * halo, roi->h + 2 * halo, border == BORDER_ZERO)) {
+		return -1;
+	}
+	struct pixel_source src = { .fd = fileno(infile), .data_offset = ftello(infile), .w = w };
+	struct stat st;
+	struct image whole = { NULL, 0, 0, 0, NULL };
+	if (src.data_offset < 0 || fstat(src.fd, &st) || !S_ISREG(st.st_mode)) {
+		if (read_pixels(infile, filename, w, h, &whole, NULL)) {
+			image_free(region);
+			return -1;
+		}
+		src.fd = -1;
+		src.image = &whole;
+	}
+	int err = copy_region(&src, w, h, roi, halo, border, region);
+	image_free(&whole);
+	if (err) {
+		fprintf(stderr, "\"%s\": input image read error: %s\n", filename, strerror(errno));
+		image_free(region);
+		return -1;
+	}
+	for (unsigned long y = 0; hash && y < region->h; y++) {
+		xxh64_update(hash, image_row(region, y), region->w * sizeof(PPMPixel));
+	}
+	return 0;
+}
+
+/* Compute the size in bytes of the pixel data of a width by height image into *bytes.
+ Return: 0 on success, -1 if the size overflows a size_t (or an off_t, for the file offsets).
+ */
+static int pixel_data_size(unsigned long width, unsigned long height, size_t *bytes)
+{
+	size_t pixels;
+	if (__builtin_mul_overflow(width, height, &pixels) || __builtin_mul_overflow(pixels, sizeof(PPMPixel), bytes)) {
+		return -1;
+	}
+	off_t offset;
+	return __builtin_add_overflow(*bytes, 0, &offset) ? -1 : 0;
+}
+
+/* Parse the P6 header of the image in the stream infile (see read_image) into width and height, leaving infile 
+ at the start of the pixel data. filename is only used in error messages.
+ Return: 0 on success, -1 if the header is invalid.
+ */
+static int read_header(FILE *infile, const char *filename, unsigned long int *width, unsigned long int *height)
+{
+	char magic_num[32];
+	char width_str[32];
+	char height_str[32];
+	char maxcolor_str[32];
+	int rgb;
+	// get magic number
+	getnextchunk(infile, magic_num, 16);
+	if (strcmp(magic_num, "P6") != 0) {
+		fprintf(stderr, "\"%s\": image header read error: magic number does not match P6\n", filename);
+		return -1;
+	}	
+	// get width
+	getnextchunk(infile, width_str, sizeof(width_str));
+	char* endptr;
+	errno = 0;
+	long long dimension = strtoll(width_str, &endptr, 10);
+	if (errno != 0) {
+		perror("strtol");
+		return -1;
+	}
+	if (endptr == width_str) {
+		fprintf(stderr, "\"%s\": image header read error: no digits found for width\n", filename);
+		return -1;
+	}
+	if (dimension <= 0) {
+		fprintf(stderr, "\"%s\": image header read error: width must be positive\n", filename);
+		return -1;
+	}
+	*width = dimension;
+	// get height
+	getnextchunk(infile, height_str, sizeof(height_str));
+	errno = 0;
+	dimension = strtoll(height_str, &endptr, 10);
+	if (errno != 0) {
+		perror("strtol");
+		return -1;
+	}
+	if (endptr == height_str) {
+		fprintf(stderr, "\"%s\": image header read error: no digits found for height\n", filename);
+		return -1;
+	}
+	if (dimension <= 0) {
+		fprintf(stderr, "\"%s\": image header read error: height must be positive\n", filename);
+		return -1;
+	}
+	*height = dimension;
+	// get max color value
+	getnextchunk(infile, maxcolor_str, sizeof(maxcolor_str));
+	errno = 0;
+	rgb = strtol(maxcolor_str, &endptr, 10);
+	if (errno != 0) {
+		perror("strtol");
+		return -1;
+	}
+	if (endptr == maxcolor_str) {
+		fprintf(stderr, "\"%s\": image header read error: no digits found for max rgb color value\n", filename);
+		return -1;
+	}	
+	if (rgb != RGB_COMPONENT_COLOR) {
+		fprintf(stderr, "\"%s\": image header read error: maximum rgb color value must be %d\n", filename, RGB_COMPONENT_COLOR);
+		return -1;
+	}
+	// the pixel data size must fit in memory sizes, and in the file when its size is known
+	size_t pixel_bytes;
+	if (pixel_data_size(*width, *height, &pixel_bytes)) {
+		fprintf(stderr, "\"%s\": image header read error: %lux%lu image is too large\n", filename, *width, *height);
+		return -1;
+	}
+	struct stat st;
+	off_t data_offset = ftello(infile);
+	if (data_offset >= 0 && fstat(fileno(infile), &st) == 0 && S_ISREG(st.st_mode) &&
+	    (st.st_size < data_offset || (uint64_t)(st.st_size - data_offset) < pixel_bytes)) {
+		fprintf(stderr, "\"%s\": image header read error: %lux%lu image needs %zu bytes of pixel data, the file has %lld\n",
+		        filename, *width, *height, pixel_bytes, (long long)(st.st_size - data_offset));
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse the image in the stream infile into img, see read_image. filename is only used in error messages.
+ The caller is responsible for closing infile and freeing img.
+ If roi is not NULL, only that region is read, see read_region.
+ If hash is not NULL, the image size and pixel data are fed to it as they are read.
+ */
+static int read_image_stream(FILE *infile, const char *filename, struct image *img, const struct region *roi, 
+                             unsigned long halo, enum border_mode border, struct xxh64_state *hash)
+{
+	unsigned long width, height;
+	if (read_header(infile, filename, &width, &height)) {
+		return -1;
+	}
+	if (hash) {
+		uint64_t size[2] = {width, height};
+		xxh64_update(hash, size, sizeof size);
+	}
+	if (roi) {
+		return read_region(infile, filename, width, height, roi, halo, border, img, hash);
+	}
+	return read_pixels(infile, filename, width, height, img, hash);
+}
+
+/* Open the filename image for reading, and parse it.
+    Example of a ppm header:    //http://netpbm.sourceforge.net/doc/ppm.html
+    P6                  -- image format
+    # comment           -- comment lines begin with
+    ## another comment  -- any number of comment lines
+    200 300             -- image width & height 
+    255                 -- max color value
+ 
+ Check if the image format is P6. If not, print invalid format error message.
+ If there are comments in the file, skip them. You may assume that comments exist only in the header block.
+ Read the image size information and store them in img.
+ Check the rgb component, if not 255, display error message.
+ Return: 0 on success, with the pixel data of the input image (filename) in img. The pixel data is stored in scanline
+ order from left to right (up to bottom) in 3-byte chunks (r g b values for each pixel) encoded as binary numbers,
+ each row starting on a ROW_ALIGN boundary (see struct image).
+ On failure, return -1 (eg the filename does not exist, the header is not a valid P6 image header, 
+ or there is an error while reading the file).
+ The caller is responsible for freeing img.
+ If roi is not NULL, only that region is read, with a border of halo pixels around it (see read_region, the border 
+ is filled in with border mode border past the edges of the image), and img is the bordered region.
+ If hash is not NULL, the image size and pixel data are fed to it as they are read.
+ */
+int read_image(const char *filename, struct image *img, const struct region *roi, unsigned long halo, enum border_mode border, 
+               struct xxh64_state *hash)
+{
+	FILE* infile;	
+	// open file for read-only
+	infile = fopen(filename, "r");
+	if (infile == NULL) {
+		fprintf(stderr, "\"%s\": image header read error: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	int status = read_image_stream(infile, filename, img, roi, halo, border, hash);
+	fclose(infile);
+	return status;
+}
+
+/* Same as read_image, for an image that is read from the open descriptor fd. 
+ filename is only used in error messages. fd is closed before returning.
+ */
+int read_image_fd(int fd, const char *filename, struct image *img, const struct region *roi, unsigned long halo, 
+                  enum border_mode border, struct xxh64_state *hash)
+{
+	FILE* infile = fdopen(fd, "r");
+	if (infile == NULL) {
+		fprintf(stderr, "\"%s\": image header read error: %s\n", filename, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	int status = read_image_stream(infile, filename, img, roi, halo, border, hash);
+	fclose(infile);
+	return status;
+}
+
+/* Prefetching reader of filter_strips. It reads strip k into buffers[k % 2] while the previous strip is filtered. */
+struct strip_reader {
+    struct pixel_source src;
+    unsigned long w;             //size of the image
+    unsigned long h;
+    struct region area;          //part of the image that is filtered
+    enum border_mode border;
+    unsigned long halo;          //border around each strip, the kernel radius
+    unsigned long strip_rows;    //rows of area per strip (the last one can have fewer)
+    unsigned long num_strips;
+    struct image buffers[2];     //area.w + 2 * halo by strip_rows + 2 * halo pixels each, see copy_region
+    int full[2];                 //buffers[i] holds a strip that has not been filtered yet
+    int error;                   //a read failed, or the filter gave up
+    double busy;                 //time spent reading
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+};
+
+/* Return: the number of area rows in strip k */
+static unsigned long strip_height(const struct strip_reader *sr, unsigned long k)
+{
+	unsigned long first = k * sr->strip_rows;
+	return sr->area.h - first < sr->strip_rows ? sr->area.h - first : sr->strip_rows;
+}
+
+/* Strip reader thread function: read the strips in order, each into the buffer freed by the filter. */
+void *strip_reader_threadfn(void *args)
+{
+	struct strip_reader *sr = (struct strip_reader*) args;
+	for (unsigned long k = 0; k < sr->num_strips; k++) {
+		int b = k % 2;
+		pthread_mutex_lock(&sr->mtx);
+		while (sr->full[b] && !sr->error) {
+			pthread_cond_wait(&sr->cond, &sr->mtx);
+		}
+		int stop = sr->error;
+		pthread_mutex_unlock(&sr->mtx);
+		if (stop) break;
+
+		double start_time = now_seconds();
+		struct region strip = { sr->area.x, sr->area.y + k * sr->strip_rows, sr->area.w, strip_height(sr, k) };
+		if (sr->border == BORDER_ZERO) {
+			// copy_region leaves the border past the edges of the image as it is
+			memset(sr->buffers[b].pixels, 0, (strip.h + 2 * sr->halo) * sr->buffers[b].stride);
+		}
+		int err = copy_region(&sr->src, sr->w, sr->h, &strip, sr->halo, sr->border, &sr->buffers[b]);
+		sr->busy += now_seconds() - start_time;
+
+		pthread_mutex_lock(&sr->mtx);
+		if (err) {
+			sr->error = 1;
+		} else {
+			sr->full[b] = 1;
+		}
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->mtx);
+		if (err) break;
+	}
+	return NULL;
+}
+
+/* Return: the bytes of the in-memory buffers of a job with options opts for an area_w by area_h area (input with its 
+ border, band parameters and scratch, and result or the rows copied by an in-place filter) as they are allocated, 
+ the size memory_cap is compared to.
+ */
+static unsigned long long image_buffer_bytes(unsigned long area_w, unsigned long area_h, const struct job_options *opts)
+{
+	unsigned long halo = filter_halo(opts);
+	unsigned long long in_w = area_w + 2 * halo, in_h = area_h + 2 * halo;
+	unsigned long long input = allocated_size(in_h * row_stride(in_w)) + allocated_size(opts->threads * sizeof(struct parameter));
+	size_t scratch = filter_scratch_bytes(opts, opts->threads);
+	if (scratch) input += allocated_size(scratch);
+	if (filter_inplace(opts)) return input + allocated_size(inplace_history_bytes(in_w, &opts->kernel, opts->threads));
+	return input + allocated_size(area_h * row_stride(area_w));
+}
+
+/* Fit a job with options opts for an area_w by area_h area into memory_cap: when its two buffers do not fit but the 
+ image does when filtered in place, turn on opts->inplace.
+ Return: 1 if the job still does not fit (it has to be filtered in strips), else 0.
+ */
+static int fit_memory_cap(struct job_options *opts, unsigned long area_w, unsigned long area_h)
+{
+	if (!memory_cap || image_buffer_bytes(area_w, area_h, opts) <= memory_cap) return 0;
+	struct job_options inplace = *opts;
+	inplace.inplace = 1;
+	if (!filter_inplace(&inplace) || image_buffer_bytes(area_w, area_h, &inplace) > memory_cap) return 1;
+	opts->inplace = 1;
+	return 0;
+}
+
+/* Return: the bytes of the buffers of filter_strips for strips of rows rows with a border of halo rows, whose input 
+ and result rows take in_row and out_row bytes, as they are allocated (see allocated_size, plus a page for the 
+ rounding of malloc).
+ */
+static unsigned long long strip_buffer_bytes(size_t in_row, size_t out_row, unsigned long rows, unsigned long halo)
+{
+	return 2 * (allocated_size((rows + 2 * halo) * in_row) + 4096) + allocated_size(rows * out_row) + 4096;
+}
+
+/* Return: 1 if the input of job is a regular file whose buffers (see image_buffer_bytes) are larger than memory_cap, 
+ even when filtered in place, 0 if not, -1 if its header is invalid (reported). 
+ An image that only fits in place gets job->opts.inplace set, see fit_memory_cap.
+ */
+int needs_strips(struct image_job *job)
+{
+	if (!memory_cap || job->input_fd >= 0) return 0;
+	FILE *infile = fopen(job->names.input_file_name, "r");
+	if (!infile) return 0;  // reported by the normal read
+	unsigned long w, h;
+	struct stat st;
+	int strips = 0;
+	if (fstat(fileno(infile), &st) == 0 && S_ISREG(st.st_mode)) {
+		if (read_header(infile, job->names.input_file_name, &w, &h)) {
+			fclose(infile);
+			return -1;
+		}
+		unsigned long area_w = job->opts.has_roi ? job->opts.roi.w : w;
+		unsigned long area_h = job->opts.has_roi ? job->opts.roi.h : h;
+		strips = fit_memory_cap(&job->opts, area_w, area_h);
+	}
+	fclose(infile);
+	return strips;
+}
+
+/* Filter the strips of sr into outfile (see filter_strips): start the strip reader, then filter each strip 
+ into result as soon as it has been read, and write it.
+ Return: 0 on success, -1 on failure.
+ */
+static int run_strips(struct strip_reader *sr, struct image *result, const char *input, const char *output, FILE *outfile,
+                      const struct job_options *opts, struct stage_times *times)
+{
+	write_header(outfile, sr->area.w, sr->area.h, opts->threshold != 0);
+	off_t out_offset = fflush(outfile) == 0 ? ftello(outfile) : -1;
+	if (out_offset < 0) {
+		fprintf(stderr, "\"%s\": write file error: %s\n", output, strerror(errno));
+		return -1;
+	}
+	size_t out_row = opts->threshold ? (sr->area.w + 7) / 8 : sr->area.w * sizeof(PPMPixel);  // in the file
+	pthread_mutex_init(&sr->mtx, NULL);
+	pthread_cond_init(&sr->cond, NULL);
+	pthread_t reader;
+	int err = pthread_create(&reader, NULL, &strip_reader_threadfn, (void*)sr);
+	if (err) {
+		fprintf(stderr, "pthread_create failure: %s\n", strerror(err));
+		pthread_cond_destroy(&sr->cond);
+		pthread_mutex_destroy(&sr->mtx);
+		return -1;
+	}
+	struct job_options strip_opts = *opts;
+	strip_opts.has_roi = 1;  // the strips have a border of the kernel radius
+	strip_opts.inplace = 0;  // the strip buffers are refilled while the result is written
+	int status = 0;
+	for (unsigned long k = 0; k < sr->num_strips && status == 0; k++) {
+		int b = k % 2;
+		double wait_start = now_seconds();
+		pthread_mutex_lock(&sr->mtx);
+		while (!sr->full[b] && !sr->error) {
+			pthread_cond_wait(&sr->cond, &sr->mtx);
+		}
+		int ready = sr->full[b];
+		pthread_mutex_unlock(&sr->mtx);
+		times->queue_wait += now_seconds() - wait_start;
+		if (!ready) {
+			fprintf(stderr, "\"%s\": input image read error: %s\n", input, strerror(errno));
+			status = -1;
+			break;
+		}
+
+		// the last strip can be shorter than the buffers
+		unsigned long rows = strip_height(sr, k);
+		struct image strip = sr->buffers[b];
+		strip.h = rows + 2 * sr->halo;
+		struct image strip_result = *result;
+		strip_result.h = rows;
+		double filter_start = now_seconds();
+		status = filter_bands(&strip, &strip_result, &strip_opts);
+		times->filter += now_seconds() - filter_start;
+
+		pthread_mutex_lock(&sr->mtx);
+		sr->full[b] = 0;
+		if (status) sr->error = 1;
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->mtx);
+		if (status) break;
+
+		double write_start = now_seconds();
+		if (write_rows(fileno(outfile), out_offset + (off_t)(k * sr->strip_rows * out_row), &strip_result)) {
+			fprintf(stderr, "\"%s\": write file error: %s\n", output, strerror(errno));
+			status = -1;
+		}
+		times->write += now_seconds() - write_start;
+	}
+	if (status) {
+		// stop the reader if it is waiting for a buffer
+		pthread_mutex_lock(&sr->mtx);
+		sr->error = 1;
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->mtx);
+	}
+	pthread_join(reader, NULL);
+	times->read += sr->busy;
+	pthread_cond_destroy(&sr->cond);
+	pthread_mutex_destroy(&sr->mtx);
+	return status;
+}
+
+/* Out-of-core filter: filter the image in the regular file input (or its region opts->roi) into output in horizontal
+ strips, so that no more than memory_cap bytes of buffers are used whatever the size of the image.
+ Each strip is read with pread along with its border of the kernel radius (see copy_region, which fills in the border past the 
+ edges with opts->border exactly as the whole-image filter sees it), filtered by the band threads, and its rows are 
+ written with pwritev at their place in output (see write_rows). Two input buffers let a reader thread prefetch the next strip while the 
+ current one is filtered.
+ On success width and height are set to the size of the output image, and the time spent reading, filtering and 
+ writing is added to times.
+ Return: 0 on success, -1 on failure.
+ */
+int filter_strips(const char *input, char *output, const struct job_options *opts, unsigned long *width, unsigned long *height, 
+                  struct stage_times *times)
+{
+	double start_time = now_seconds();
+	if (opts->canny) {
+		// the hysteresis follows the edges across the whole image
+		fprintf(stderr, "\"%s\": Canny edge detection needs the whole image in memory, more than the memory cap %llu\n", 
+		        input, memory_cap);
+		return -1;
+	}
+	FILE *infile = fopen(input, "r");
+	if (!infile) {
+		fprintf(stderr, "\"%s\": image header read error: %s\n", input, strerror(errno));
+		return -1;
+	}
+	struct strip_reader sr;
+	memset(&sr, 0, sizeof sr);
+	if (read_header(infile, input, &sr.w, &sr.h)) {
+		fclose(infile);
+		return -1;
+	}
+	sr.src.fd = fileno(infile);
+	sr.src.data_offset = ftello(infile);
+	sr.src.w = sr.w;
+	sr.border = opts->border;
+	sr.halo = kernel_radius(&opts->kernel);
+	sr.area = opts->has_roi ? opts->roi : (struct region){ 0, 0, sr.w, sr.h };
+	if (sr.area.w > sr.w || sr.area.x > sr.w - sr.area.w || sr.area.h > sr.h || sr.area.y > sr.h - sr.area.h) {
+		fprintf(stderr, "\"%s\": region %lu,%lu,%lu,%lu is outside the %lux%lu image\n", input, 
+		        sr.area.x, sr.area.y, sr.area.w, sr.area.h, sr.w, sr.h);
+		fclose(infile);
+		return -1;
+	}
+	// two input strips of strip_rows + 2 * halo rows of area.w + 2 * halo pixels, and one result strip of strip_rows rows 
+	// of area.w pixels
+	size_t in_row = row_stride(sr.area.w + 2 * sr.halo);
+	size_t out_row = row_stride(sr.area.w);
+	struct job_options strip_opts = *opts;
+	strip_opts.inplace = 0;
+	unsigned long long params = opts->threads * sizeof(struct parameter) + filter_scratch_bytes(&strip_opts, opts->threads);
+	unsigned long long fixed = 4 * sr.halo * in_row + params;
+	sr.strip_rows = memory_cap > fixed ? (memory_cap - fixed) / (2 * in_row + out_row) : 0;
+	if (sr.strip_rows > sr.area.h) sr.strip_rows = sr.area.h;
+	// the buffer pool and huge pages round the buffers up: shrink the strips until they fit as allocated
+	while (sr.strip_rows > 0 && strip_buffer_bytes(in_row, out_row, sr.strip_rows, sr.halo) + params > memory_cap) {
+		sr.strip_rows -= (sr.strip_rows + 15) / 16;
+	}
+	if (sr.strip_rows == 0) {
+		fprintf(stderr, "\"%s\": memory cap %llu is too small for a strip of one row (%llu bytes)\n", input, memory_cap, 
+		        strip_buffer_bytes(in_row, out_row, 1, sr.halo) + params);
+		fclose(infile);
+		return -1;
+	}
+	sr.num_strips = (sr.area.h + sr.strip_rows - 1) / sr.strip_rows;
+	struct image result = { NULL, 0, 0, 0, NULL };
+	int status = -1;
+	if (image_alloc(&sr.buffers[0], sr.area.w + 2 * sr.halo, sr.strip_rows + 2 * sr.halo, 0) == 0 &&
+	    image_alloc(&sr.buffers[1], sr.area.w + 2 * sr.halo, sr.strip_rows + 2 * sr.halo, 0) == 0 &&
+	    image_alloc(&result, sr.area.w, sr.strip_rows, 0) == 0 && make_parent_dirs(output) == 0) {
+		FILE *outfile = fopen(output, "w");
+		if (!outfile) {
+			fprintf(stderr, "\"%s\": write file error: %s\n", output, strerror(errno));
+		} else {
+			times->read += now_seconds() - start_time;
+			status = run_strips(&sr, &result, input, output, outfile, opts, times);
+			if (fclose(outfile)) {
+				fprintf(stderr, "\"%s\": write file error: %s\n", output, strerror(errno));
+				status = -1;
+			}
+		}
+	}
+	*width = sr.area.w;
+	*height = sr.area.h;
+	fclose(infile);
+	image_free(&sr.buffers[0]);
+	image_free(&sr.buffers[1]);
+	image_free(&result);
+	return status;
+}
+
+/* Initialize an empty queue that holds at most capacity jobs and is fed by the given number of producers.
+ Return: 0 on success, an error number on failure.
+ */
+int job_queue_init(struct job_queue *q, unsigned long capacity, int producers)
+{
+	q->head = NULL;
+	q->tail = NULL;
+	q->count = 0;
+	q->capacity = capacity < 1 ? 1 : capacity;
+	q->producers = producers;
+	int err = pthread_mutex_init(&q->mtx, NULL);
+	if (err) return err;
+	err = pthread_cond_init(&q->not_empty, NULL);
+	if (err) return err;
+	return pthread_cond_init(&q->not_full, NULL);
+}
+
+void job_queue_destroy(struct job_queue *q)
+{
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->mtx);
+}
+
+/* Append job to the tail of the queue, blocking while the queue is full. 
+ */
+void job_queue_push(struct job_queue *q, struct image_job *job)
+{
+	pthread_mutex_lock(&q->mtx);
+	while (q->count >= q->capacity) {
+		pthread_cond_wait(&q->not_full, &q->mtx);
+	}
+	job->next = NULL;
+	job->enqueue_time = now_seconds();
+	if (q->tail) {
+		q->tail->next = job;
+	} else {
+		q->head = job;
+	}
+	q->tail = job;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->mtx);
+}
+
+/* Remove the job at the head of the queue, blocking while the queue is empty.
+ Return: the job, or NULL once the queue is empty and every producer has closed it.
+ */
+struct image_job *job_queue_pop(struct job_queue *q)
+{
+	pthread_mutex_lock(&q->mtx);
+	while (q->count == 0 && q->producers > 0) {
+		pthread_cond_wait(&q->not_empty, &q->mtx);
+	}
+	struct image_job *job = q->head;
+	if (job) {
+		q->head = job->next;
+		if (!q->head) q->tail = NULL;
+		q->count--;
+		job->times.queue_wait += now_seconds() - job->enqueue_time;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->mtx);
+	return job;
+}
+
+/* Called by a producer once it will not push any more jobs. The last producer to close the queue
+ wakes up every consumer so they can drain it and exit.
+ */
+void job_queue_close(struct job_queue *q)
+{
+	pthread_mutex_lock(&q->mtx);
+	if (--q->producers == 0) {
+		pthread_cond_broadcast(&q->not_empty);
+	}
+	pthread_mutex_unlock(&q->mtx);
+}
+
+/* Parse a thread or queue count given on the command line. 
+ Return: the count, or -1 if arg is not a positive integer.
+ */
+static long parse_count(const char *arg)
+{
+	char *endptr;
+	errno = 0;
+	long n = strtol(arg, &endptr, 10);
+	if (errno != 0 || endptr == arg || *endptr != '\0' || n < 1) {
+		return -1;
+	}
+	return n;
+}
+
+/* Parse a memory size given on the command line into size: an integer with an optional K, M or G suffix (powers of 1024).
+ Return: 0 on success, -1 if arg is not a valid size.
+ */
+static int parse_size(const char *arg, unsigned long long *size)
+{
+	char *endptr;
+	errno = 0;
+	unsigned long long n = strtoull(arg, &endptr, 10);
+	if (errno != 0 || endptr == arg || arg[0] == '-') {
+		return -1;
+	}
+	int shift = 0;
+	switch (*endptr) {
+	case 'K': case 'k': shift = 10; endptr++; break;
+	case 'M': case 'm': shift = 20; endptr++; break;
+	case 'G': case 'g': shift = 30; endptr++; break;
+	}
+	if (*endptr != '\0' || n > (~0ULL >> shift)) {
+		return -1;
+	}
+	*size = n << shift;
+	return 0;
+}
+
+void job_options_init(struct job_options *opts)
+{
+	*opts = default_options;
+}
+
+/* Return: whether the key of a "key=value" option of key_len characters is key. */
+static int option_key_is(const char *option, size_t key_len, const char *key)
+{
+	return key_len == strlen(key) && strncmp(option, key, key_len) == 0;
+}
+
+/* Return: x rounded to the nearest int, halves away from zero */
+static inline int round_int(double x)
+{
+	return x < 0 ? -(int)(-x + 0.5) : (int)(x + 0.5);
+}
+
+/* Largest sum of the 1-D taps of gauss-N: the horizontal pass of split_kernel sums them in int16_t */
+#define GAUSS_TAPS_SUM (INT16_MAX / RGB_COMPONENT_COLOR)
+
+/* Fill k with the n by n kernel (n odd, 3 to KERNEL_MAX_SIZE) of the family gauss or log, sampled with a sigma of n / 6
+ so that it reaches 3 sigma on each side, and rounded to integers. 
+ The Gaussian is the outer product of 1-D integer taps with itself, so that it splits into two passes (see 
+ split_kernel): the taps are scaled to sum to at most GAUSS_TAPS_SUM, and the divisor is the exact sum of the kernel.
+ The Laplacian of Gaussian has the sign of log5, a positive center of 1024 with divisor 64 (16 once divided, like 
+ log5), and its center is adjusted so that the coefficients sum to zero. It is rounded on the whole grid, so it does
+ not split and runs on the engine or the FFT.
+ Return: 0 on success, -1 if family is unknown.
+ */
+static int make_kernel(const char *family, int n, struct kernel *k)
+{
+	int log = strcmp(family, "log") == 0;
+	if (!log && strcmp(family, "gauss") != 0) return -1;
+	int r = n / 2;
+	double s2 = 2.0 * n * n / 36;    // 2 sigma^2
+	k->w = k->h = n;
+	if (!log) {
+		double g[KERNEL_MAX_SIZE], total = 0;
+		int taps[KERNEL_MAX_SIZE], sum = 0;
+		for (int x = -r; x <= r; x++) total += g[x + r] = exp(-x * x / s2);
+		// rounding may push the sum past the largest one, then scale down until it fits
+		for (double scale = GAUSS_TAPS_SUM; ; scale--) {
+			sum = 0;
+			for (int i = 0; i < n; i++) sum += taps[i] = round_int(scale * g[i] / total);
+			if (sum <= GAUSS_TAPS_SUM) break;
+		}
+		for (int y = 0; y < n; y++) {
+			for (int x = 0; x < n; x++) k->coeffs[y * n + x] = taps[y] * taps[x];
+		}
+		k->divisor = sum * sum;
+		return 0;
+	}
+	k->divisor = 64;
+	int sum = 0;
+	for (int y = -r; y <= r; y++) {
+		for (int x = -r; x <= r; x++) {
+			double d = (x * x + y * y) / s2;
+			int *c = &k->coeffs[(y + r) * n + x + r];
+			*c = round_int(1024 * (1 - d) * exp(-d));
+			sum += *c;
+		}
+	}
+	k->coeffs[r * n + r] -= sum;
+	return 0;
+}
+
+/* Parse a kernel: the name of a kernel of kernel_catalog, gauss-N or log-N (see make_kernel), or 
+ WxH:c,c,...[/divisor] with the H rows of W coefficients (W and H odd, at most KERNEL_MAX_SIZE, the sum of their 
+ absolute values at most KERNEL_MAX_WEIGHT), e.g. 3x3:1,2,1,2,4,2,1,2,1/16.
+ Return: 0 on success, with the kernel in k, -1 if value is not a kernel.
+ */
+static int parse_kernel(const char *value, struct kernel *k)
+{
+	for (int i = 0; i < NUM_CATALOG_KERNELS; i++) {
+		if (strcmp(value, kernel_catalog[i].name) == 0) {
+			*k = *kernel_catalog[i].kernel;
+			return 0;
+		}
+	}
+	char family[8];
+	int n, consumed = 0;
+	if (sscanf(value, "%7[a-z]-%d%n", family, &n, &consumed) == 2 && value[consumed] == '\0') {
+		if (n < 3 || n > KERNEL_MAX_SIZE || n % 2 == 0) return -1;
+		return make_kernel(family, n, k);
+	}
+	struct kernel parsed = { .divisor = 1 };
+	long weight = 0;
+	consumed = 0;
+	if (sscanf(value, "%dx%d:%n", &parsed.w, &parsed.h, &consumed) != 2 || consumed == 0 || 
+	    parsed.w < 1 || parsed.w > KERNEL_MAX_SIZE || parsed.w % 2 == 0 || 
+	    parsed.h < 1 || parsed.h > KERNEL_MAX_SIZE || parsed.h % 2 == 0) {
+		return -1;
+	}
+	const char *p = value + consumed;
+	for (int i = 0; i < parsed.w * parsed.h; i++) {
+		if (i > 0 && *p++ != ',') return -1;
+		char *end;
+		errno = 0;
+		long c = strtol(p, &end, 10);
+		if (end == p || errno || c < -65535 || c > 65535) return -1;
+		weight += c < 0 ? -c : c;
+		if (weight > KERNEL_MAX_WEIGHT) return -1;
+		parsed.coeffs[i] = c;
+		p = end;
+	}
+	if (*p == '/') {
+		char *end;
+		errno = 0;
+		long d = strtol(p + 1, &end, 10);
+		if (end == p + 1 || errno || d == 0 || d < -65535 || d > 65535) return -1;
+		parsed.divisor = d;
+		p = end;
+	}
+	if (*p != '\0') return -1;
+	*k = parsed;
+	return 0;
+}
+
+/* Apply one "key=value" job option (e.g. "threads=8" or "roi=x,y,w,h") to opts.
+ Return: 0 on success, -1 if the option is unknown or its value is invalid.
+ */
+int parse_job_option(struct job_options *opts, const char *option)
+{
+	const char *value = strchr(option, '=');
+	if (!value) return -1;
+	size_t key_len = value - option;
+	value++;
+	if (option_key_is(option, key_len, "threads")) {
+		long n = parse_count(value);
+		if (n < 0) return -1;
+		opts->threads = n;
+		return 0;
+	}
+	if (option_key_is(option, key_len, "variant")) {
+		int variant = find_filter_variant(value);
+		if (variant < 0) return -1;
+		opts->variant = variant;
+		return 0;
+	}
+	if (option_key_is(option, key_len, "border")) {
+		for (int mode = 0; mode < NUM_BORDER_MODES; mode++) {
+			if (strcmp(value, border_mode_names[mode]) == 0) {
+				opts->border = mode;
+				return 0;
+			}
+		}
+		return -1;
+	}
+	if (option_key_is(option, key_len, "kernel")) {
+		return parse_kernel(value, &opts->kernel);
+	}
+	if (option_key_is(option, key_len, "inplace")) {
+		if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) return -1;
+		opts->inplace = value[0] == '1';
+		return 0;
+	}
+	if (option_key_is(option, key_len, "canny")) {
+		int low = CANNY_LOW, high = CANNY_HIGH, consumed = 0;
+		if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0 && 
+		    (sscanf(value, "%d,%d%n", &low, &high, &consumed) != 2 || value[consumed] != '\0' || low < 0 || low > high)) {
+			return -1;
+		}
+		opts->canny = strcmp(value, "0") != 0;
+		opts->canny_low = low;
+		opts->canny_high = high;
+		return 0;
+	}
+	if (option_key_is(option, key_len, "threshold")) {
+		long n = parse_count(value);
+		if (strcmp(value, "0") != 0 && (n < 1 || n > RGB_COMPONENT_COLOR)) return -1;
+		opts->threshold = n < 0 ? 0 : n;
+		return 0;
+	}
+	if (option_key_is(option, key_len, "roi")) {
+		struct region roi;
+		int consumed = 0;
+		if (value[0] == '-' || sscanf(value, "%lu,%lu,%lu,%lu%n", &roi.x, &roi.y, &roi.w, &roi.h, &consumed) != 4 || 
+		    value[consumed] != '\0' || roi.w < 1 || roi.h < 1) {
+			return -1;
+		}
+		opts->has_roi = 1;
+		opts->roi = roi;
+		return 0;
+	}
+	return -1;
+}
+
+/* Allocate a job for the given input and output file names, with the default job options.
+ Return: the job, or NULL on failure. The job owns copies of both names.
+ */
+struct image_job *new_job(const char *input_file_name, const char *output_file_name)
+{
+	struct image_job *job = calloc(1, sizeof(struct image_job));
+	if (!job) {
+		return NULL;
+	}
+	job->names.input_file_name = strdup(input_file_name);
+	job->names.output_file_name = strdup(output_file_name);
+	if (!job->names.input_file_name || !job->names.output_file_name) {
+		free(job->names.input_file_name);
+		free(job->names.output_file_name);
+		free(job);
+		return NULL;
+	}
+	static long next_job_id = 0;
+	job_options_init(&job->opts);
+	job->id = __atomic_fetch_add(&next_job_id, 1, __ATOMIC_RELAXED);
+	job->input_fd = -1;
+	job->cache_fd = -1;
+	job->submit_time = now_seconds();
+	return job;
+}
+
+void free_job(struct image_job *job)
+{
+	image_free(&job->image);
+	image_free(&job->result);
+	free(job->names.input_file_name);
+	free(job->names.output_file_name);
+	free(job);
+}
+
+/* Build a job from a line of the form "input output [key=value ...]". The line is modified.
+ On failure a message is written to err.
+ Return: the job, or NULL on failure.
+ */
+struct image_job *parse_job_line(char *line, char *err, size_t errsiz)
+{
+	char *saveptr;
+	char *input = strtok_r(line, " \t\r\n", &saveptr);
+	char *output = strtok_r(NULL, " \t\r\n", &saveptr);
+	if (!input || !output) {
+		snprintf(err, errsiz, "expected: input output [key=value ...]");
+		return NULL;
+	}
+	struct image_job *job = new_job(input, output);
+	if (!job) {
+		snprintf(err, errsiz, "%s", strerror(errno));
+		return NULL;
+	}
+	char *option;
+	while ((option = strtok_r(NULL, " \t\r\n", &saveptr))) {
+		if (parse_job_option(&job->opts, option)) {
+			snprintf(err, errsiz, "invalid option \"%s\"", option);
+			free_job(job);
+			return NULL;
+		}
+	}
+	return job;
+}
+
+/* Write s to out as a JSON string, quotes included. */
+static void json_write_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			fprintf(out, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+/* Write the recorded spans to path in Chrome trace-event format and free the buffers. 
+ Must be called once the threads that recorded spans have been joined.
+ Return: 0 on success, -1 on failure.
+ */
+int trace_write(const char *path)
+{
+	FILE *out = fopen(path, "w");
+	if (!out) {
+		fprintf(stderr, "\"%s\": trace file error: %s\n", path, strerror(errno));
+	}
+	struct trace_buffer *buffers = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE);
+	// time 0 of the trace is the earliest span
+	double origin = -1;
+	for (struct trace_buffer *buf = buffers; buf; buf = buf->next) {
+		if (buf->head && buf->head->count && (origin < 0 || buf->head->events[0].start < origin)) origin = buf->head->events[0].start;
+	}
+	long pid = getpid();
+	if (out) fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	int first = 1;
+	while (buffers) {
+		struct trace_buffer *buf = buffers;
+		if (out) {
+			fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":", first ? "" : ",\n", pid, buf->tid);
+			json_write_string(out, buf->thread_name);
+			fprintf(out, "}}");
+			first = 0;
+		}
+		while (buf->head) {
+			struct trace_chunk *chunk = buf->head;
+			for (int i = 0; i < chunk->count && out; i++) {
+				struct trace_event *e = &chunk->events[i];
+				fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+				        e->name, pid, buf->tid, (e->start - origin) * 1e6, (e->end - e->start) * 1e6);
+				const char *sep = "";
+				if (e->image >= 0) {
+					fprintf(out, "\"image\":%ld", e->image);
+					sep = ",";
+				}
+				if (e->band >= 0) {
+					fprintf(out, "%s\"band\":%d", sep, e->band);
+					sep = ",";
+				}
+				if (e->file) {
+					fprintf(out, "%s\"file\":", sep);
+					json_write_string(out, e->file);
+				}
+				fprintf(out, "}}");
+			}
+			for (int i = 0; i < chunk->count; i++) free(chunk->events[i].file);
+			buf->head = chunk->next;
+			free(chunk);
+		}
+		buffers = buf->next;
+		free(buf);
+	}
+	trace_buffers = NULL;
+	if (!out) return -1;
+	fprintf(out, "\n]}\n");
+	if (fclose(out)) {
+		fprintf(stderr, "\"%s\": trace file error: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Write s to out as a CSV field, quoted if it contains a separator, a quote or a line break. */
+static void csv_write_string(FILE *out, const char *s)
+{
+	if (!strpbrk(s, ",\"\r\n")) {
+		fputs(s, out);
+		return;
+	}
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"') fputc('"', out);
+		fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+/* Columns of the CSV metrics. Image rows leave the summary columns empty, and the summary row the image columns. */
+#define METRICS_CSV_HEADER "record,input,output,status,cached,width,height,input_bytes,output_bytes,threads,read_s,filter_s,write_s," \
+	"queue_wait_s,latency_s,mpix_per_s,images,failures,readers,filters,writers,wall_s,images_per_s,total_mpix_per_s,p50_s,p95_s,p99_s," \
+	"mem_peak_bytes,max_rss_kb,pool_hits,pool_misses,minor_faults,major_faults\n"
+
+/* Write the metrics record of a job that just left the pipeline with the given status, and keep its latency.
+ */
+void record_job_metrics(struct image_job *job, int status)
+{
+	double latency = now_seconds() - job->submit_time;
+	struct stage_times *t = &job->times;
+	unsigned long long row_bytes = job->opts.threshold ? (job->w + 7) / 8 : job->w * sizeof(PPMPixel);
+	unsigned long long output_bytes = status == 0 ? row_bytes * job->h : 0;
+	double mpix_per_s = status == 0 && t->filter > 0 ? job->w * job->h / t->filter / 1e6 : 0;
+	pthread_mutex_lock(&mtx_metrics);
+	if (status == 0) {
+		if (num_latencies == latencies_capacity) {
+			unsigned long capacity = latencies_capacity ? 2 * latencies_capacity : 1024;
+			double *latencies = realloc(job_latencies, capacity * sizeof(double));
+			if (latencies) {
+				job_latencies = latencies;
+				latencies_capacity = capacity;
+			}
+		}
+		if (num_latencies < latencies_capacity) {
+			job_latencies[num_latencies++] = latency;
+		}
+	}
+	FILE *out = metrics_out;
+	if (metrics_format == METRICS_JSON) {
+		fprintf(out, "{\"record\":\"image\",\"input\":");
+		json_write_string(out, job->names.input_file_name);
+		fprintf(out, ",\"output\":");
+		json_write_string(out, job->names.output_file_name);
+		fprintf(out, ",\"status\":\"%s\",\"cached\":%s,\"width\":%lu,\"height\":%lu,\"input_bytes\":%llu,\"output_bytes\":%llu,"
+		        "\"threads\":%d,\"read_s\":%.6f,\"filter_s\":%.6f,\"write_s\":%.6f,\"queue_wait_s\":%.6f,\"latency_s\":%.6f,"
+		        "\"mpix_per_s\":%.3f,\"mem_peak_bytes\":%lld}\n",
+		        status == 0 ? "ok" : "error", job->cache_hit ? "true" : "false", job->w, job->h, job->input_bytes, output_bytes,
+		        job->opts.threads, t->read, t->filter, t->write, t->queue_wait, latency, mpix_per_s, job->mem.peak);
+	} else {
+		fprintf(out, "image,");
+		csv_write_string(out, job->names.input_file_name);
+		fputc(',', out);
+		csv_write_string(out, job->names.output_file_name);
+		fprintf(out, ",%s,%d,%lu,%lu,%llu,%llu,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,,,,,,,,,,,,%lld,,,,,\n",
+		        status == 0 ? "ok" : "error", job->cache_hit, job->w, job->h, job->input_bytes, output_bytes,
+		        job->opts.threads, t->read, t->filter, t->write, t->queue_wait, latency, mpix_per_s, job->mem.peak);
+	}
+	pthread_mutex_unlock(&mtx_metrics);
+}
+
+/* Called when a job leaves the pipeline, with status 0 if it was written and -1 if a stage failed.
+ A job submitted by the server is handed back to its waiter, any other job is freed.
+ */
+void finish_job(struct image_job *job, int status)
+{
+	if (status != 0) {
+		pthread_mutex_lock(&mtx_metrics);
+		failed_images++;
+		pthread_mutex_unlock(&mtx_metrics);
+	}
+	if (metrics_format != METRICS_NONE) {
+		record_job_metrics(job, status);
+	}
+	image_free(&job->image);
+	image_free(&job->result);
+	job->status = status;
+	if (!job->waiter) {
+		free_job(job);
+		return;
+	}
+	struct job_waiter *waiter = job->waiter;
+	pthread_mutex_lock(&waiter->mtx);
+	waiter->finished = 1;
+	pthread_cond_signal(&waiter->cond);
+	pthread_mutex_unlock(&waiter->mtx);
+}
+
+/* Size of a cache key buffer: enough for a custom kernel of KERNEL_MAX_SIZE by KERNEL_MAX_SIZE coefficients */
+#define CACHE_KEY_MAX (128 + 8 * KERNEL_MAX_SIZE * KERNEL_MAX_SIZE)
+
+/* Describe the job options that change the output image, for the cache key. 
+ Options that only change how the work is done (eg. threads) are left out.
+ */
+void job_options_cache_key(const struct job_options *opts, char *buf, size_t bufsiz)
+{
+	int len = snprintf(buf, bufsiz, "laplacian3x3");
+	const struct kernel *k = &opts->kernel;
+	int catalog = find_catalog_kernel(k);
+	if (opts->canny && len < bufsiz) {
+		len += snprintf(buf + len, bufsiz - len, ";canny=%d,%d", opts->canny_low, opts->canny_high);
+	} else if (catalog > 0 && len < bufsiz) {
+		len += snprintf(buf + len, bufsiz - len, ";kernel=%s", kernel_catalog[catalog].name);
+	} else if (catalog < 0 && len < bufsiz) {
+		len += snprintf(buf + len, bufsiz - len, ";kernel=%dx%d:", k->w, k->h);
+		for (int i = 0; i < k->w * k->h && len < bufsiz; i++) {
+			len += snprintf(buf + len, bufsiz - len, i ? ",%d" : "%d", k->coeffs[i]);
+		}
+		if (len < bufsiz) len += snprintf(buf + len, bufsiz - len, "/%d", k->divisor);
+	}
+	if (opts->border != BORDER_WRAP && len < bufsiz) {
+		len += snprintf(buf + len, bufsiz - len, ";border=%s", border_mode_names[opts->border]);
+	}
+	if (opts->threshold && len < bufsiz) {
+		len += snprintf(buf + len, bufsiz - len, ";threshold=%d", opts->threshold);
+	}
+	if (opts->has_roi && len < bufsiz) {
+		snprintf(buf + len, bufsiz - len, ";roi=%lu,%lu,%lu,%lu", opts->roi.x, opts->roi.y, opts->roi.w, opts->roi.h);
+	}
+}
+
+/* Path of the cache entry of job, named after its cache key, with the extension of its output format (.pbm with 
+ threshold=N). The caller is responsible for freeing the returned path.
+ */
+static char *cache_path(const struct image_job *job)
+{
+	char *path;
+	const char *ext = job->opts.threshold ? "pbm" : "ppm";
+	if (asprintf(&path, "%s/%016llx.%s", cache_dir, (unsigned long long)job->cache_key, ext) < 0) {
+		return NULL;
+	}
+	return path;
+}
+
+/* Copy the open file in, named src, to dst, sharing the data blocks (reflink) when the file system supports it.
+ in is closed.
+ Return: number of bytes copied, or -1 on failure.
+ */
+static long long copy_fd(int in, const char *src, const char *dst)
+{
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (out < 0) {
+		fprintf(stderr, "\"%s\": write file error: %s\n", dst, strerror(errno));
+		close(in);
+		return -1;
+	}
+	struct stat st;
+	long long copied = -1;
+	if (fstat(in, &st) == 0) {
+		if (ioctl(out, FICLONE, in) == 0) {
+			copied = st.st_size;
+		} else {
+			// no reflink, copy in the kernel, or through a buffer if the file systems do not allow that
+			copied = 0;
+			ssize_t n;
+			while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0) {
+				copied += n;
+			}
+			if (n < 0 && copied == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+				char buf[1 << 16];
+				while ((n = read(in, buf, sizeof buf)) > 0) {
+					if (write(out, buf, n) != n) {
+						n = -1;
+						break;
+					}
+					copied += n;
+				}
+			}
+			if (n < 0) {
+				copied = -1;
+			}
+		}
+	}
+	if (copied < 0) {
+		fprintf(stderr, "\"%s\": copy to \"%s\" failed: %s\n", src, dst, strerror(errno));
+	}
+	close(in);
+	if (close(out)) {
+		copied = -1;
+	}
+	return copied;
+}
+
+/* Copy the file src to dst, see copy_fd.
+ Return: number of bytes copied, or -1 on failure.
+ */
+static long long copy_file(const char *src, const char *dst)
+{
+	int in = open(src, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		return -1;
+	}
+	return copy_fd(in, src, dst);
+}
+
+/* Store the output of job in the cache. The entry is copied under a temporary name and then renamed,
+ so a concurrent lookup never sees a partial file.
+ */
+void cache_store(struct image_job *job)
+{
+	static unsigned long tmp_counter = 0;
+	char *path = cache_path(job);
+	char *tmp_path = NULL;
+	pthread_mutex_lock(&mtx_cache);
+	unsigned long tmp_id = tmp_counter++;
+	pthread_mutex_unlock(&mtx_cache);
+	if (!path || asprintf(&tmp_path, "%s.%d.%lu.tmp", path, (int)getpid(), tmp_id) < 0) {
+		free(path);
+		return;
+	}
+	if (copy_file(job->names.output_file_name, tmp_path) < 0 || rename(tmp_path, path)) {
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	free(path);
+}
+
+/* Copy the cache entry opened by cache_lookup to the output file of job, and close it.
+ Return: 0 on success, -1 on failure.
+ */
+int cache_fetch(struct image_job *job)
+{
+	int in = job->cache_fd;
+	job->cache_fd = -1;
+	char *path = cache_path(job);
+	if (!path || make_parent_dirs(job->names.output_file_name)) {
+		free(path);
+		close(in);
+		return -1;
+	}
+	long long copied = copy_fd(in, path, job->names.output_file_name);
+	free(path);
+	if (copied < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&mtx_cache);
+	cache_hits++;
+	cache_bytes_saved += copied;
+	pthread_mutex_unlock(&mtx_cache);
+	return 0;
+}
+
+/* Finish the cache key of job from the hash of its pixels and its options, and check whether the cache has it.
+ On a hit the entry is opened in job->cache_fd, so it stays readable for cache_fetch even if it is replaced 
+ or removed from the cache meanwhile.
+ Return: 1 on a hit, 0 on a miss.
+ */
+int cache_lookup(struct image_job *job, struct xxh64_state *hash)
+{
+	char key[CACHE_KEY_MAX];
+	job_options_cache_key(&job->opts, key, sizeof key);
+	xxh64_update(hash, key, strlen(key));
+	job->cache_key = xxh64_digest(hash);
+	char *path = cache_path(job);
+	job->cache_fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+	int hit = job->cache_fd >= 0;
+	free(path);
+	if (!hit) {
+		pthread_mutex_lock(&mtx_cache);
+		cache_misses++;
+		pthread_mutex_unlock(&mtx_cache);
+	}
+	return hit;
+}
+
+/* Reader stage thread function. Read each image file taken from the read queue and pass it on to 
+ the filter stage. Images that fail to read are reported and dropped.
+ When the cache has the result of an image, the image skips the filter stage and goes straight to the writers.
+ Images larger than the memory cap are not read here, the filter stage processes them in strips.
+ */
+void *read_stage_threadfn(void *args)
+{
+	struct pipeline *pl = (struct pipeline*) args;
+	struct image_job *job;
+	trace_set_thread_name("reader");
+	while ((job = job_queue_pop(&pl->read_q))) {
+		mem_owner = &job->mem;
+		int strips = needs_strips(job);
+		if (strips < 0) {
+			fprintf(stderr, "\"%s\": input image read error, no output image created\n", job->names.input_file_name);
+			finish_job(job, -1);
+			continue;
+		}
+		if (strips) {
+			// too large for the memory cap: the filter stage streams it from and to its files
+			job->out_of_core = 1;
+			job_queue_push(&pl->filter_q, job);
+			continue;
+		}
+		double start_time = now_seconds();
+		struct xxh64_state hash;
+		xxh64_reset(&hash, 0);
+		struct xxh64_state *hashp = cache_dir ? &hash : NULL;
+		const struct region *roi = job->opts.has_roi ? &job->opts.roi : NULL;
+		struct perf_counts counts;
+		int counting = perf_begin(&counts) == 0;
+		double trace_start = trace_begin();
+		int status;
+		if (job->input_fd >= 0) {
+			status = read_image_fd(job->input_fd, job->names.input_file_name, &job->image, roi, filter_halo(&job->opts), job->opts.border, hashp); // freed by the writer
+			job->input_fd = -1;
+		} else {
+			status = read_image(job->names.input_file_name, &job->image, roi, filter_halo(&job->opts), job->opts.border, hashp); // freed by the writer
+		}
+		job->w = job->image.w;
+		job->h = job->image.h;
+		if (counting && status == 0) perf_end(&counts, PERF_READ, (unsigned long long)job->w * job->h);
+		if (trace_enabled) trace_record("read", trace_start, job->id, -1, job->names.input_file_name);
+		if (status) {
+			fprintf(stderr, "\"%s\": input image read error, no output image created\n", job->names.input_file_name);
+			finish_job(job, -1);
+			continue;
+		}
+		job->input_bytes = (unsigned long long)job->w * job->h * sizeof(PPMPixel);
+		int hit = cache_dir && cache_lookup(job, &hash);
+		job->times.read = now_seconds() - start_time;
+		if (hit) {
+			job->cache_hit = 1;
+			image_free(&job->image);
+			job_queue_push(&pl->write_q, job);
+			continue;
+		}
+		job_queue_push(&pl->filter_q, job);
+	}
+	job_queue_close(&pl->filter_q);
+	perf_thread_close();
+	return NULL;
+}
+
+/* Filter stage thread function. Apply the Laplacian filter to each image taken from the filter queue
+ and pass the image on to the writer stage. 
+ The input image is released as soon as it has been filtered. 
+ Out-of-core images are read, filtered and written here strip by strip (filter_strips).
+ */
+void *filter_stage_threadfn(void *args)
+{
+	struct pipeline *pl = (struct pipeline*) args;
+	struct image_job *job;
+	trace_set_thread_name("filter");
+	while ((job = job_queue_pop(&pl->filter_q))) {
+		mem_owner = &job->mem;
+		double trace_start = trace_begin();
+		trace_image = job->id;
+		if (job->out_of_core) {
+			int status = filter_strips(job->names.input_file_name, job->names.output_file_name, &job->opts, &job->w, &job->h, &job->times);
+			if (trace_enabled) trace_record("filter", trace_start, job->id, -1, job->names.input_file_name);
+			if (status) {
+				fprintf(stderr, "\"%s\": filter error, output image incomplete\n", job->names.input_file_name);
+				finish_job(job, -1);
+				continue;
+			}
+			job->input_bytes = (unsigned long long)job->w * job->h * sizeof(PPMPixel);
+			job_queue_push(&pl->write_q, job);
+			continue;
+		}
+		int status = apply_filters(&job->image, &job->result, &job->opts, &job->times.filter); // freed by the writer
+		if (trace_enabled) trace_record("filter", trace_start, job->id, -1, NULL);
+		image_free(&job->image);
+		if (status) {
+			fprintf(stderr, "\"%s\": filter error, no output image created\n", job->names.input_file_name);
+			finish_job(job, -1);
+			continue;
+		}
+		// with a region of interest the result does not have the border of the region
+		job->w = job->result.w;
+		job->h = job->result.h;
+		job_queue_push(&pl->write_q, job);
+	}
+	job_queue_close(&pl->write_q);
+	return NULL;
+}
+
+/* Writer stage thread function. Save each result taken from the write queue in its output file
+ (copying it from the cache on a cache hit, and adding it to the cache otherwise), then release the job.
+ Print the time the image spent in each stage, and add it to total_times.
+ */
+void *write_stage_threadfn(void *args)
+{
+	struct pipeline *pl = (struct pipeline*) args;
+	struct image_job *job;
+	trace_set_thread_name("writer");
+	while ((job = job_queue_pop(&pl->write_q))) {
+		mem_owner = &job->mem;
+		double start_time = now_seconds();
+		int status;
+		if (job->cache_hit) {
+			status = cache_fetch(job);
+		} else if (job->out_of_core) {
+			status = 0;  // already written by filter_strips
+		} else {
+			struct perf_counts counts;
+			int counting = perf_begin(&counts) == 0;
+			status = write_image(&job->result, job->names.output_file_name);
+			if (counting && status == 0) perf_end(&counts, PERF_WRITE, (unsigned long long)job->w * job->h);
+			if (trace_enabled) trace_record("write", start_time, job->id, -1, NULL);
+			if (status == 0 && cache_dir) {
+				cache_store(job);
+			}
+		}
+		struct stage_times *t = &job->times;
+		t->write += now_seconds() - start_time;
+		if (status == 0) {
+			pthread_mutex_lock(&mtx_etime);
+			total_times.read += t->read;
+			total_times.filter += t->filter;
+			total_times.write += t->write;
+			total_times.queue_wait += t->queue_wait;
+			total_images++;
+			total_mpix += job->w * job->h / 1e6;
+			pthread_mutex_unlock(&mtx_etime);
+		}
+		if (!job->waiter) {
+			fprintf(report_out, "Input image: %s, Output image: %s, Elapsed time: %f (read %f, write %f, queue wait %f, peak memory %lld)%s\n", 
+			       job->names.input_file_name, job->names.output_file_name, 
+			       t->filter, t->read, t->write, t->queue_wait, job->mem.peak, job->cache_hit ? " (cached)" : "");
+		}
+		finish_job(job, status);
+	}
+	perf_thread_close();
+	return NULL;
+}
+
+/* Create the queues and start readers, filters and writers threads for each stage, along with the 
+ band pool that the filters share (filters * threads band threads).
+ The read queue is fed by a single producer (the caller), which must close it when done.
+ Return: 0 on success, -1 on failure.
+ */
+int pipeline_start(struct pipeline *pl, int readers, int filters, int writers, unsigned long queue_depth)
+{
+	pl->readers = readers;
+	pl->filters = filters;
+	pl->writers = writers;
+	if (job_queue_init(&pl->read_q, queue_depth, 1) ||
+	    job_queue_init(&pl->filter_q, queue_depth, readers) ||
+	    job_queue_init(&pl->write_q, queue_depth, filters)) {
+		fprintf(stderr, "pipeline queue initialization failure\n");
+		return -1;
+	}
+	if (band_pool_start(&band_pool, filters * default_options.threads)) {
+		return -1;
+	}
+	pl->threads = malloc((readers + filters + writers) * sizeof(pthread_t));
+	if (!pl->threads) {
+		perror("malloc");
+		return -1;
+	}
+	void *(*stage_fn[3])(void *) = {&read_stage_threadfn, &filter_stage_threadfn, &write_stage_threadfn};
+	int stage_threads[3] = {readers, filters, writers};
+	int t = 0;
+	for (int stage = 0; stage < 3; stage++) {
+		for (int i = 0; i < stage_threads[stage]; i++) {
+			int err = pthread_create(&pl->threads[t++], NULL, stage_fn[stage], (void*)pl);
+			if (err) {
+				// threads already started would block forever on their queues, so there is no clean way back
+				fprintf(stderr, "pthread_create failure: %s\n", strerror(err));
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	return 0;
+}
+
+/* Wait for every stage to drain, then release the pipeline. The read queue must have been closed.
+ */
+void pipeline_finish(struct pipeline *pl)
+{
+	int num_threads = pl->readers + pl->filters + pl->writers;
+	for (int i = 0; i < num_threads; i++) {
+		int err = pthread_join(pl->threads[i], NULL);
+		if (err) 
+			fprintf(stderr, "pthread_join error: %s", strerror(err));
+	}
+	free(pl->threads);
+	band_pool_stop(&band_pool);
+	job_queue_destroy(&pl->read_q);
+	job_queue_destroy(&pl->filter_q);
+	job_queue_destroy(&pl->write_q);
+}
+
+/* Settings for the pipeline, shared by the batch driver and the server. */
+struct pipeline_config {
+	long readers;
+	long filters;
+	long writers;
+	long queue_depth;
+	const char *manifest;        //manifest file name ("-" for standard input), or NULL to take files from argv
+	const char *metrics_path;    //file the metrics are written to, or NULL for standard output
+	const char *trace_path;      //file the timeline is written to, or NULL when not tracing
+	int dry_run;                 //--dry-run: only read the headers and predict the peak memory
+	long bench_reps;             //with --bench N: repetitions per thread count, 0 for a normal run
+	const char *bench_threads;   //comma separated band thread counts to sweep, or NULL for the default sweep
+	const char *bench_csv;       //file the experiment.sh rows are appended to, or NULL
+	const char *bench_file_csv;  //file the experimentfilesize.sh rows are appended to, or NULL
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: ./edge_detector [pipeline options] filenames[s]\n"
+	                "       ./edge_detector serve [pipeline options] socket\n"
+	                "       ./edge_detector client socket input|- output [key=value ...]\n"
+	                "       ./edge_detector loadtest socket input [requests [concurrency]]\n"
+	                "       ./edge_detector [pipeline options] --manifest jobs.txt|-\n"
+	                "pipeline options: [--readers N] [--filters N] [--writers N] [--queue-depth N] [--threads N] [--cache DIR]\n"
+	                "                  [--option key=value] (default job options) [--metrics json|csv] [--metrics-out FILE] [--counters]\n"
+	                "                  [--trace FILE] [--dry-run] [--memory-cap SIZE[K|M|G]] [--pool-limit SIZE[K|M|G]] [--huge-pages off|thp|hugetlb]\n"
+	                "       ./edge_detector --bench N [--bench-threads N,...] [--bench-csv FILE] [--bench-file-csv FILE] filenames[s]\n"
+	                "       ./edge_detector bench [--sizes tiny,hd,8k,strip|WxH,...] [--kernels name,...] [--variants name,...] [--warmup N] [--reps N] [--threads N]\n"
+	                "manifest lines: input output [key=value ...]\n"
+	                "job options: threads=N roi=x,y,w,h variant=name border=wrap|clamp|mirror|zero inplace=0|1 canny=0|1|low,high\n"
+	                "             threshold=0|N (1-bit PBM of the pixels with a component from N)\n"
+	                "             kernel=name|gauss-N|log-N|WxH:c,c,...[/divisor], kernels:");
+	for (int i = 0; i < NUM_CATALOG_KERNELS; i++) {
+		fprintf(stderr, " %s", kernel_catalog[i].name);
+	}
+	fprintf(stderr, "\n");
+}
+
+/* Parse the pipeline options at the start of argv into config, and the default job options into default_options.
+ Return: index of the first non-option argument, or -1 on a bad option.
+ */
+int parse_pipeline_options(int argc, char *argv[], struct pipeline_config *config)
+{
+	static const struct option long_options[] = {
+		{"readers",     required_argument, NULL, 'r'},
+		{"filters",     required_argument, NULL, 'f'},
+		{"writers",     required_argument, NULL, 'w'},
+		{"queue-depth", required_argument, NULL, 'q'},
+		{"threads",     required_argument, NULL, 't'},
+		{"manifest",    required_argument, NULL, 'm'},
+		{"cache",       required_argument, NULL, 'c'},
+		{"option",      required_argument, NULL, 'o'},
+		{"metrics",     required_argument, NULL, 'M'},
+		{"metrics-out", required_argument, NULL, 'O'},
+		{"counters",    no_argument,       NULL, 'P'},
+		{"trace",       required_argument, NULL, 'x'},
+		{"dry-run",     no_argument,       NULL, 'n'},
+		{"memory-cap",  required_argument, NULL, 'L'},
+		{"pool-limit",  required_argument, NULL, 'p'},
+		{"huge-pages",  required_argument, NULL, 'H'},
+		{"bench",       required_argument, NULL, 'b'},
+		{"bench-threads",  required_argument, NULL, 'T'},
+		{"bench-csv",      required_argument, NULL, 'C'},
+		{"bench-file-csv", required_argument, NULL, 'F'},
+		{NULL, 0, NULL, 0}
+	};
+	config->readers = READER_THREADS;
+	config->filters = FILTER_THREADS;
+	config->writers = WRITER_THREADS;
+	config->queue_depth = QUEUE_DEPTH;
+	config->manifest = NULL;
+	config->metrics_path = NULL;
+	config->trace_path = NULL;
+	config->dry_run = 0;
+	config->bench_reps = 0;
+	config->bench_threads = NULL;
+	config->bench_csv = NULL;
+	config->bench_file_csv = NULL;
+	long threads;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "r:f:w:q:t:m:c:o:M:O:Px:nL:p:H:b:T:C:F:", long_options, NULL)) != -1) {
+		long *count;
+		switch (opt) {
+		case 'm': 
+			config->manifest = optarg; 
+			continue;
+		case 'c':
+			cache_dir = optarg;
+			continue;
+		case 'M':
+			if (strcmp(optarg, "json") == 0) {
+				metrics_format = METRICS_JSON;
+			} else if (strcmp(optarg, "csv") == 0) {
+				metrics_format = METRICS_CSV;
+			} else {
+				fprintf(stderr, "\"%s\": metrics format must be json or csv\n", optarg);
+				return -1;
+			}
+			continue;
+		case 'O':
+			config->metrics_path = optarg;
+			continue;
+		case 'P':
+			perf_enabled = 1;
+			continue;
+		case 'x':
+			config->trace_path = optarg;
+			trace_enabled = 1;
+			continue;
+		case 'n':
+			config->dry_run = 1;
+			continue;
+		case 'L':
+			if (parse_size(optarg, &memory_cap) || !memory_cap) {
+				fprintf(stderr, "\"%s\": expected a size in bytes, with an optional K, M or G suffix\n", optarg);
+				return -1;
+			}
+			continue;
+		case 'p':
+			if (parse_size(optarg, &pool_limit)) {
+				fprintf(stderr, "\"%s\": expected a size in bytes, with an optional K, M or G suffix\n", optarg);
+				return -1;
+			}
+			continue;
+		case 'H':
+			for (huge_pages = 0; huge_pages < NUM_HUGE_PAGE_MODES; huge_pages++) {
+				if (strcmp(optarg, huge_page_mode_names[huge_pages]) == 0) break;
+			}
+			if (huge_pages == NUM_HUGE_PAGE_MODES) {
+				fprintf(stderr, "\"%s\": huge page mode must be off, thp or hugetlb\n", optarg);
+				return -1;
+			}
+			continue;
+		case 'T':
+			config->bench_threads = optarg;
+			continue;
+		case 'C':
+			config->bench_csv = optarg;
+			continue;
+		case 'F':
+			config->bench_file_csv = optarg;
+			continue;
+		case 'o':
+			if (parse_job_option(&default_options, optarg)) {
+				fprintf(stderr, "\"%s\": invalid job option\n", optarg);
+				return -1;
+			}
+			continue;
+		case 'r': count = &config->readers; break;
+		case 'f': count = &config->filters; break;
+		case 'w': count = &config->writers; break;
+		case 'q': count = &config->queue_depth; break;
+		case 't': count = &threads; break;
+		case 'b': count = &config->bench_reps; break;
+		default:
+			return -1;
+		}
+		*count = parse_count(optarg);
+		if (*count < 0) {
+			fprintf(stderr, "\"%s\": expected a positive number\n", optarg);
+			return -1;
+		}
+		if (count == &threads) {
+			default_options.threads = threads;
+		}
+	}
+	return optind;
+}
+
+/* Open the metrics sink: config->metrics_path, or standard output, in which case the human-readable report 
+ moves to standard error so that standard output only has metrics.
+ Return: 0 on success, -1 on failure.
+ */
+int open_metrics(const struct pipeline_config *config)
+{
+	if (config->metrics_path) {
+		metrics_out = fopen(config->metrics_path, "w");
+		if (!metrics_out) {
+			fprintf(stderr, "\"%s\": metrics file error: %s\n", config->metrics_path, strerror(errno));
+			return -1;
+		}
+	} else {
+		metrics_out = stdout;
+		report_out = stderr;
+	}
+	if (metrics_format == METRICS_CSV) {
+		fputs(METRICS_CSV_HEADER, metrics_out);
+	}
+	return 0;
+}
+
+void close_metrics(void)
+{
+	if (metrics_out && metrics_out != stdout) {
+		fclose(metrics_out);
+	}
+	metrics_out = NULL;
+	free(job_latencies);
+	job_latencies = NULL;
+}
+
+/* Return: the maximum resident set size of the process so far, in KiB (getrusage). */
+static long max_rss_kb(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) return 0;
+	return usage.ru_maxrss;
+}
+
+/* Get the minor and major page faults of the process so far (getrusage). */
+static void page_faults(long *minor, long *major)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		*minor = *major = 0;
+		return;
+	}
+	*minor = usage.ru_minflt;
+	*major = usage.ru_majflt;
+}
+
+/* Write the summary record of the run: image counts, throughput, and the percentiles of the image latencies.
+ */
+void write_metrics_summary(const struct pipeline_config *config, double wall_time)
+{
+	qsort(job_latencies, num_latencies, sizeof(double), compare_doubles);
+	double p50 = num_latencies ? percentile(job_latencies, num_latencies, 50) : 0;
+	double p95 = num_latencies ? percentile(job_latencies, num_latencies, 95) : 0;
+	double p99 = num_latencies ? percentile(job_latencies, num_latencies, 99) : 0;
+	double images_per_s = wall_time > 0 ? num_latencies / wall_time : 0;
+	double mpix_per_s = wall_time > 0 ? total_mpix / wall_time : 0;
+	long max_rss = max_rss_kb();
+	long minor_faults, major_faults;
+	page_faults(&minor_faults, &major_faults);
+	if (metrics_format == METRICS_JSON) {
+		fprintf(metrics_out, "{\"record\":\"summary\",\"images\":%lu,\"failures\":%lu,\"readers\":%ld,\"filters\":%ld,\"writers\":%ld,"
+		        "\"threads\":%d,\"read_s\":%.6f,\"filter_s\":%.6f,\"write_s\":%.6f,\"queue_wait_s\":%.6f,\"wall_s\":%.6f,"
+		        "\"images_per_s\":%.3f,\"mpix_per_s\":%.3f,\"p50_s\":%.6f,\"p95_s\":%.6f,\"p99_s\":%.6f,"
+		        "\"mem_peak_bytes\":%lld,\"max_rss_kb\":%ld,\"pool_hits\":%lu,\"pool_misses\":%lu,"
+		        "\"minor_faults\":%ld,\"major_faults\":%ld}\n",
+		        num_latencies, failed_images, config->readers, config->filters, config->writers, default_options.threads,
+		        total_times.read, total_times.filter, total_times.write, total_times.queue_wait, wall_time,
+		        images_per_s, mpix_per_s, p50, p95, p99, mem_run.peak, max_rss, pool_hits, pool_misses, minor_faults, major_faults);
+	} else {
+		fprintf(metrics_out, "summary,,,,,,,,,%d,%.6f,%.6f,%.6f,%.6f,,,%lu,%lu,%ld,%ld,%ld,%.6f,%.3f,%.3f,%.6f,%.6f,%.6f,%lld,%ld,%lu,%lu,%ld,%ld\n",
+		        default_options.threads, total_times.read, total_times.filter, total_times.write, total_times.queue_wait,
+		        num_latencies, failed_images, config->readers, config->filters, config->writers, wall_time,
+		        images_per_s, mpix_per_s, p50, p95, p99, mem_run.peak, max_rss, pool_hits, pool_misses, minor_faults, major_faults);
+	}
+	fflush(metrics_out);
+}
+
+/* Print the totals of the run: the total elapsed time, the time spent in each stage, how busy each stage's
+ threads were over the wall_time of the run (the busiest stage is the one to give more threads), and the cache
+ counters when the cache is enabled. With --metrics, also write the summary record.
+ */
+void print_summary(const struct pipeline_config *config, double wall_time)
+{
+	if (metrics_format != METRICS_NONE) {
+		write_metrics_summary(config, wall_time);
+	}
+	fprintf(report_out, "Total elapsed time: %.4f\n", total_times.filter);
+	fprintf(report_out, "Stage times over %lu images: read %.4f, filter %.4f, write %.4f, queue wait %.4f, wall %.4f\n", total_images, 
+	       total_times.read, total_times.filter, total_times.write, total_times.queue_wait, wall_time);
+	if (wall_time > 0) {
+		fprintf(report_out, "Stage utilization: read %.1f%% (%ld threads), filter %.1f%% (%ld threads), write %.1f%% (%ld threads)\n",
+		       100 * total_times.read / (config->readers * wall_time), config->readers,
+		       100 * total_times.filter / (config->filters * wall_time), config->filters,
+		       100 * total_times.write / (config->writers * wall_time), config->writers);
+	}
+	if (cache_dir) {
+		fprintf(report_out, "Cache hits: %lu, Cache misses: %lu, Bytes saved: %llu\n", cache_hits, cache_misses, cache_bytes_saved);
+	}
+	fprintf(report_out, "Memory: peak image buffers %lld bytes, live at exit %lld bytes, max RSS %ld KiB\n",
+	        mem_run.peak, mem_run.live, max_rss_kb());
+	long minor_faults, major_faults;
+	page_faults(&minor_faults, &major_faults);
+	unsigned long requests = pool_hits + pool_misses;
+	fprintf(report_out, "Buffer pool: hits %lu, misses %lu (hit rate %.1f%%), %llu bytes pooled, page faults %ld minor, %ld major\n",
+	        pool_hits, pool_misses, requests ? 100.0 * pool_hits / requests : 0.0, pool_bytes, minor_faults, major_faults);
+	huge_print_summary(report_out);
+	perf_print_summary(report_out);
+}
+
+/* Set while the server should keep accepting connections, cleared by SIGINT or SIGTERM */
+static volatile sig_atomic_t server_running = 1;
+
+static void server_stop_handler(int sig)
+{
+	server_running = 0;
+}
+
+/* State shared by the server connection threads. */
+struct server {
+	struct pipeline *pl;
+	int active;                  //connection threads still running
+	int *conn_fds;               //descriptors of the active connections, to interrupt them at shutdown
+	int conn_capacity;
+	pthread_mutex_t mtx;
+	pthread_cond_t idle;         //signalled when active drops to zero
+};
+
+struct server_connection {
+	struct server *srv;
+	int fd;
+};
+
+/* Receive one request packet into buf (NUL terminated), along with a descriptor if the client passed one. Any other 
+ descriptor passed with it is closed. *truncated is set when the packet did not fit in buf, the request is then cut
+ and its descriptor closed.
+ Return: length of the request, 0 when the client disconnected, -1 on error.
+ */
+static ssize_t server_receive(int fd, char *buf, size_t bufsiz, int *passed_fd, int *truncated)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { .iov_base = buf, .iov_len = bufsiz - 1 };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	*passed_fd = -1;
+	ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0) return -1;
+	buf[n] = '\0';
+	// the descriptors that do not fit in control are closed by the kernel (MSG_CTRUNC), the others here
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+		size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; i++) {
+			int passed;
+			memcpy(&passed, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+			if (*passed_fd < 0) {
+				*passed_fd = passed;
+			} else {
+				close(passed);
+			}
+		}
+	}
+	*truncated = (msg.msg_flags & MSG_TRUNC) != 0;
+	if (*truncated && *passed_fd >= 0) {
+		close(*passed_fd);
+		*passed_fd = -1;
+	}
+	return n;
+}
+
+/* Build a pipeline job from a request of the form "input output [key=value ...]", where input is "-" 
+ when the image is read from passed_fd. On failure an error reply is written to reply.
+ Return: the job, or NULL on failure.
+ */
+static struct image_job *server_parse_request(char *request, int passed_fd, char *reply, size_t replysiz)
+{
+	char err[SERVER_MAX_MESSAGE - sizeof "error " + 1];   // fits in a reply after "error "
+	struct image_job *job = parse_job_line(request, err, sizeof err);
+	if (!job) {
+		snprintf(reply, replysiz, "error %s", err);
+		return NULL;
+	}
+	if (strcmp(job->names.input_file_name, "-") == 0) {
+		if (passed_fd < 0) {
+			snprintf(reply, replysiz, "error input is \"-\" but no descriptor was passed");
+			free_job(job);
+			return NULL;
+		}
+		job->input_fd = passed_fd;
+	} else if (passed_fd >= 0) {
+		close(passed_fd);
+	}
+	return job;
+}
+
+/* Server connection thread function. Run each request on the connection through the pipeline and
+ reply with "ok read=<seconds> filter=<seconds> write=<seconds> queue_wait=<seconds> total=<seconds>" 
+ or "error <message>", until the client disconnects.
+ */
+void *server_connection_threadfn(void *args)
+{
+	struct server_connection *conn = (struct server_connection*) args;
+	struct server *srv = conn->srv;
+	char request[SERVER_MAX_MESSAGE];
+	char reply[SERVER_MAX_MESSAGE];
+	struct job_waiter waiter;
+	pthread_mutex_init(&waiter.mtx, NULL);
+	pthread_cond_init(&waiter.cond, NULL);
+	for (;;) {
+		int passed_fd, truncated;
+		ssize_t n = server_receive(conn->fd, request, sizeof request, &passed_fd, &truncated);
+		if (n <= 0) break;
+		double start = now_seconds();
+		struct image_job *job = NULL;
+		if (truncated) {
+			snprintf(reply, sizeof reply, "error request too long");
+		} else {
+			job = server_parse_request(request, passed_fd, reply, sizeof reply);
+		}
+		if (job) {
+			waiter.finished = 0;
+			job->waiter = &waiter;
+			job_queue_push(&srv->pl->read_q, job);
+			pthread_mutex_lock(&waiter.mtx);
+			while (!waiter.finished) {
+				pthread_cond_wait(&waiter.cond, &waiter.mtx);
+			}
+			pthread_mutex_unlock(&waiter.mtx);
+			if (job->status == 0) {
+				snprintf(reply, sizeof reply, "ok read=%f filter=%f write=%f queue_wait=%f total=%f", job->times.read, 
+				         job->times.filter, job->times.write, job->times.queue_wait, now_seconds() - start);
+			} else {
+				snprintf(reply, sizeof reply, "error could not process \"%s\"", job->names.input_file_name);
+			}
+			free_job(job);
+		} else if (passed_fd >= 0) {
+			close(passed_fd);
+		}
+		if (send(conn->fd, reply, strlen(reply), MSG_NOSIGNAL) < 0) break;
+	}
+	pthread_cond_destroy(&waiter.cond);
+	pthread_mutex_destroy(&waiter.mtx);
+
+	pthread_mutex_lock(&srv->mtx);
+	for (int i = 0; i < srv->active; i++) {
+		if (srv->conn_fds[i] == conn->fd) {
+			srv->conn_fds[i] = srv->conn_fds[srv->active - 1];
+			break;
+		}
+	}
+	if (--srv->active == 0) {
+		pthread_cond_signal(&srv->idle);
+	}
+	pthread_mutex_unlock(&srv->mtx);
+	close(conn->fd);
+	free(conn);
+	return NULL;
+}
+
+/* Run the pipeline as a server listening on the Unix domain socket socket_path, until SIGINT or SIGTERM.
+ Each connection gets its own thread, and its requests are fed to the shared pipeline.
+ */
+int serve(const char *socket_path, struct pipeline_config *config)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "\"%s\": socket path is too long\n", socket_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+	int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) || listen(listen_fd, SOMAXCONN)) {
+		fprintf(stderr, "\"%s\": %s\n", socket_path, strerror(errno));
+		close(listen_fd);
+		return -1;
+	}
+
+	// SIGINT/SIGTERM stay blocked in every thread, and are only let through while the main thread waits 
+	// for a connection in ppoll, so they always interrupt the accept loop
+	sigset_t stop_signals;
+	sigset_t wait_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+	sigdelset(&wait_mask, SIGINT);
+	sigdelset(&wait_mask, SIGTERM);
+	struct sigaction sa = { .sa_handler = server_stop_handler };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	double start_time = now_seconds();
+	struct pipeline pl;
+	if (pipeline_start(&pl, config->readers, config->filters, config->writers, config->queue_depth)) {
+		close(listen_fd);
+		return -1;
+	}
+
+	struct server srv = { .pl = &pl };
+	pthread_mutex_init(&srv.mtx, NULL);
+	pthread_cond_init(&srv.idle, NULL);
+	fprintf(report_out, "Listening on %s\n", socket_path);
+	fflush(report_out);
+	while (server_running) {
+		struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+		if (ppoll(&pfd, 1, NULL, &wait_mask) < 0) {
+			if (errno != EINTR) perror("ppoll");
+			continue;
+		}
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			perror("accept");
+			continue;
+		}
+		struct server_connection *conn = malloc(sizeof(struct server_connection));
+		pthread_mutex_lock(&srv.mtx);
+		if (conn && srv.active == srv.conn_capacity) {
+			int capacity = srv.conn_capacity ? 2 * srv.conn_capacity : 16;
+			int *conn_fds = realloc(srv.conn_fds, capacity * sizeof(int));
+			if (conn_fds) {
+				srv.conn_fds = conn_fds;
+				srv.conn_capacity = capacity;
+			}
+		}
+		if (!conn || srv.active == srv.conn_capacity) {
+			pthread_mutex_unlock(&srv.mtx);
+			fprintf(stderr, "out of memory, connection dropped\n");
+			free(conn);
+			close(fd);
+			continue;
+		}
+		conn->srv = &srv;
+		conn->fd = fd;
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		int err = pthread_create(&thread, &attr, &server_connection_threadfn, (void*)conn);
+		pthread_attr_destroy(&attr);
+		if (err) {
+			pthread_mutex_unlock(&srv.mtx);
+			fprintf(stderr, "pthread_create failure: %s\n", strerror(err));
+			free(conn);
+			close(fd);
+			continue;
+		}
+		srv.conn_fds[srv.active++] = fd;
+		pthread_mutex_unlock(&srv.mtx);
+	}
+
+	// stop reading new requests, let the connections finish the jobs in flight, then drain the pipeline
+	close(listen_fd);
+	unlink(socket_path);
+	pthread_mutex_lock(&srv.mtx);
+	for (int i = 0; i < srv.active; i++) {
+		shutdown(srv.conn_fds[i], SHUT_RD);
+	}
+	while (srv.active > 0) {
+		pthread_cond_wait(&srv.idle, &srv.mtx);
+	}
+	pthread_mutex_unlock(&srv.mtx);
+	job_queue_close(&pl.read_q);
+	pipeline_finish(&pl);
+	free(srv.conn_fds);
+	pthread_cond_destroy(&srv.idle);
+	pthread_mutex_destroy(&srv.mtx);
+	print_summary(config, now_seconds() - start_time);
+	pool_release();
+	if (config->trace_path && trace_write(config->trace_path)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Connect to the server listening on socket_path.
+ Return: the connected descriptor, or -1 on failure.
+ */
+static int client_connect(const char *socket_path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "\"%s\": socket path is too long\n", socket_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr*)&addr, sizeof addr)) {
+		fprintf(stderr, "\"%s\": %s\n", socket_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Send one request to the server, passing input_fd along with it unless it is -1, and wait for the reply.
+ Return: 0 if the server replied "ok", -1 otherwise.
+ */
+static int client_request(int fd, const char *request, int input_fd, char *reply, size_t replysiz)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { .iov_base = (void*)request, .iov_len = strlen(request) };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (input_fd >= 0) {
+		memset(&control, 0, sizeof control);
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &input_fd, sizeof(int));
+	}
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+		snprintf(reply, replysiz, "error %s", strerror(errno));
+		return -1;
+	}
+	ssize_t n = recv(fd, reply, replysiz - 1, 0);
+	if (n <= 0) {
+		snprintf(reply, replysiz, "error %s", n < 0 ? strerror(errno) : "server closed the connection");
+		return -1;
+	}
+	reply[n] = '\0';
+	return strncmp(reply, "ok", 2) == 0 ? 0 : -1;
+}
+
+/* Make path absolute relative to the current directory, since the server does not share our working directory.
+ Return: a newly allocated path, or NULL on failure.
+ */
+static char *absolute_path(const char *path)
+{
+	if (path[0] == '/' || strcmp(path, "-") == 0) {
+		return strdup(path);
+	}
+	char cwd[4096];
+	if (!getcwd(cwd, sizeof cwd)) {
+		perror("getcwd");
+		return NULL;
+	}
+	char *result = malloc(strlen(cwd) + strlen(path) + 2);
+	if (result) {
+		sprintf(result, "%s/%s", cwd, path);
+	}
+	return result;
+}
+
+/* Build the request line "input output [options...]" with input and output made absolute.
+ Return: 0 on success, -1 on failure.
+ */
+static int client_build_request(char *request, size_t requestsiz, const char *input, const char *output, int num_options, char *options[])
+{
+	char *abs_input = absolute_path(input);
+	char *abs_output = absolute_path(output);
+	if (!abs_input || !abs_output) {
+		free(abs_input);
+		free(abs_output);
+		return -1;
+	}
+	size_t len = snprintf(request, requestsiz, "%s %s", abs_input, abs_output);
+	free(abs_input);
+	free(abs_output);
+	for (int i = 0; i < num_options && len < requestsiz; i++) {
+		len += snprintf(request + len, requestsiz - len, " %s", options[i]);
+	}
+	if (len >= requestsiz) {
+		fprintf(stderr, "request is longer than %d bytes\n", SERVER_MAX_MESSAGE);
+		return -1;
+	}
+	return 0;
+}
+
+/* The client subcommand: client socket input|- output [key=value ...]
+ Submit one job to the server and print its reply. An input of "-" passes our standard input to the server.
+ */
+int client_main(int argc, char *argv[])
+{
+	if (argc < 4) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	char request[SERVER_MAX_MESSAGE];
+	char reply[SERVER_MAX_MESSAGE];
+	if (client_build_request(request, sizeof request, argv[2], argv[3], argc - 4, argv + 4)) {
+		return EXIT_FAILURE;
+	}
+	int fd = client_connect(argv[1]);
+	if (fd < 0) {
+		return EXIT_FAILURE;
+	}
+	int status = client_request(fd, request, strcmp(argv[2], "-") == 0 ? STDIN_FILENO : -1, reply, sizeof reply);
+	close(fd);
+	printf("%s\n", reply);
+	return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-			result[img_y * w + img_x].r = red; 
-			result[img_y * w + img_x].g = green; 
-			result[img_y * w + img_x].b = blue;
+/* Shared state of the load test client threads. */
+struct loadtest {
+	const char *socket_path;
+	const char *request;
+	long requests;
+	long next;                   //next request number to send, protected by mtx
+	long failures;
+	double *latencies;           //latency of each request, in seconds
+	pthread_mutex_t mtx;
+};
+
+/* Load test thread function. Send requests over one connection, one at a time, until all have been sent. */
+void *loadtest_threadfn(void *args)
+{
+	struct loadtest *lt = (struct loadtest*) args;
+	char reply[SERVER_MAX_MESSAGE];
+	int fd = client_connect(lt->socket_path);
+	for (;;) {
+		pthread_mutex_lock(&lt->mtx);
+		long i = lt->next < lt->requests ? lt->next++ : -1;
+		pthread_mutex_unlock(&lt->mtx);
+		if (i < 0) break;
+		double start = now_seconds();
+		int status = fd < 0 ? -1 : client_request(fd, lt->request, -1, reply, sizeof reply);
+		lt->latencies[i] = now_seconds() - start;
+		if (status) {
+			pthread_mutex_lock(&lt->mtx);
+			if (lt->failures++ == 0) fprintf(stderr, "%s\n", fd < 0 ? "connection failed" : reply);
+			pthread_mutex_unlock(&lt->mtx);
 		}
-	}	
-    return NULL; // nothing to return
+	}
+	if (fd >= 0) close(fd);
+	return NULL;
 }
 
-/* Apply the Laplacian filter to an image using threads.
- Each thread shall do an equal share of the work, i.e. work=height/number of threads. If the size is not even, 
- the last thread shall take the rest of the work.Compute the elapsed time and store it in *elapsedTime (Read about gettimeofday).
- Return: result (filtered image). The caller is responsible for freeing result.
+/* The loadtest subcommand: loadtest socket input [requests [concurrency]]
+ Send the same job (output to /dev/null) requests times from concurrency connections, 
+ then print the request rate and the latency distribution.
  */
-PPMPixel *apply_filters(PPMPixel *image, unsigned long w, unsigned long h, double *elapsedTime) {
-	// start elapsed time
-	struct timeval start_time;
-	if (gettimeofday(&start_time, NULL)) perror("gettimeofday");
-
-	int num_threads = (h / LAPLACIAN_THREADS) < 1 ? h : LAPLACIAN_THREADS; // cap number of threads to the height of the image - prevents threads from doing zero work
-	pthread_t threads[num_threads];
-	PPMPixel *result = malloc(w * h * sizeof(PPMPixel));
-	if (!result) {
-		perror("malloc");
-		return NULL;
+int loadtest_main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		usage();
+		return EXIT_FAILURE;
 	}
-
-	struct parameter* params = (struct parameter*) malloc(num_threads * sizeof(struct parameter));
-	if (!params) {
+	long requests = argc > 3 ? parse_count(argv[3]) : 100;
+	long concurrency = argc > 4 ? parse_count(argv[4]) : 1;
+	if (requests < 0 || concurrency < 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	char request[SERVER_MAX_MESSAGE];
+	if (client_build_request(request, sizeof request, argv[2], "/dev/null", 0, NULL)) {
+		return EXIT_FAILURE;
+	}
+	struct loadtest lt = { .socket_path = argv[1], .request = request, .requests = requests };
+	lt.latencies = calloc(requests, sizeof(double));
+	pthread_t *threads = malloc(concurrency * sizeof(pthread_t));
+	if (!lt.latencies || !threads) {
 		perror("malloc");
-		return NULL;
+		return EXIT_FAILURE;
 	}
-	
-	// Split image processing between evenly between threads. 
-	// Last thread takes care of what's left, in case of an odd number of lines to process.
-	int i;
-    for (i = 0; i < num_threads - 1; i++) {
-		params[i].image = image;
-		params[i].result = result;
-		params[i].w = w;
-		params[i].h = h;
-		params[i].size = h/num_threads;
-		params[i].start = i * params[i].size;
-		pthread_create(&threads[i], NULL, &compute_laplacian_threadfn, (void*)&params[i]);
-	}   
-	params[i].image = image;
-	params[i].result = result;
-	params[i].w = w;
-	params[i].h = h;
-	params[i].start = i * (h/num_threads);
-	params[i].size = h - params[i].start;
-	pthread_create(&threads[i], NULL, &compute_laplacian_threadfn, (void*)&params[i]);
+	pthread_mutex_init(&lt.mtx, NULL);
+	double start = now_seconds();
+	for (long i = 0; i < concurrency; i++) {
+		int err = pthread_create(&threads[i], NULL, &loadtest_threadfn, (void*)&lt);
+		if (err) {
+			fprintf(stderr, "pthread_create failure: %s\n", strerror(err));
+			return EXIT_FAILURE;
+		}
+	}
+	for (long i = 0; i < concurrency; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	double elapsed = now_seconds() - start;
+	qsort(lt.latencies, requests, sizeof(double), compare_doubles);
+	printf("Requests: %ld, Concurrency: %ld, Failures: %ld, Elapsed time: %.4f\n", requests, concurrency, lt.failures, elapsed);
+	printf("Requests per second: %.1f\n", requests / elapsed);
+	printf("Latency (ms): p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n",
+	       percentile(lt.latencies, requests, 50) * 1000, percentile(lt.latencies, requests, 90) * 1000,
+	       percentile(lt.latencies, requests, 99) * 1000, percentile(lt.latencies, requests, 99.9) * 1000,
+	       lt.latencies[requests - 1] * 1000);
+	pthread_mutex_destroy(&lt.mtx);
+	free(threads);
+	free(lt.latencies);
+	return lt.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-	for (int i = 0; i < num_threads; i++) {
-		int err = pthread_join(threads[i], NULL);
-		if (err) { 
-			fprintf(stderr, "pthread_join failure: %s", strerror(err));
-			return NULL;
+/* A synthetic image size for the bench subcommand. */
+struct bench_size {
+    const char *name;
+    unsigned long w;
+    unsigned long h;
+};
+
+static const struct bench_size bench_sizes[] = {
+	{"tiny",  64,      64},
+	{"hd",    1920,    1080},
+	{"8k",    7680,    4320},
+	{"strip", 1048576, 64},  // gigapixel-wide strip, cut to 64 rows to stay within memory
+};
+
+/* Return: cycle counter (TSC) on x86, 0 where there is none. */
+static inline uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Fill a w x h image with pseudo random pixels. The generator is seeded with a constant,
+ so every run on every machine filters the same image.
+ Return: 0 on success, -1 if the image could not be allocated. The caller is responsible for freeing it.
+ */
+int make_synthetic_image(struct image *image, unsigned long w, unsigned long h)
+{
+	if (image_alloc(image, w, h, 0)) {
+		return -1;
+	}
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+	for (unsigned long y = 0; y < h; y++) {
+		unsigned char *bytes = (unsigned char *)image_row(image, y);
+		for (unsigned long i = 0; i < w * sizeof(PPMPixel); i++) {
+			// xorshift64
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			bytes[i] = (unsigned char)(x >> 56);
 		}
 	}
+	return 0;
+}
 
-	// end elapsed time
-	struct timeval end_time;
-	if (gettimeofday(&end_time, NULL)) perror("gettimeofday");
-	*elapsedTime = (double)end_time.tv_sec + ((double)end_time.tv_usec / 1000000) - (double)start_time.tv_sec - ((double)start_time.tv_usec / 1000000);
-	free(params);
-    return result;
+/* Parse a bench size: a name from bench_sizes or WxH.
+ Return: 0 on success, -1 if the size is invalid.
+ */
+int parse_bench_size(const char *str, struct bench_size *size)
+{
+	for (size_t i = 0; i < sizeof bench_sizes / sizeof bench_sizes[0]; i++) {
+		if (strcmp(bench_sizes[i].name, str) == 0) {
+			*size = bench_sizes[i];
+			return 0;
+		}
+	}
+	char *endptr;
+	errno = 0;
+	unsigned long w = strtoul(str, &endptr, 10);
+	if (endptr == str || *endptr != 'x' || errno) return -1;
+	const char *h_str = endptr + 1;
+	unsigned long h = strtoul(h_str, &endptr, 10);
+	size_t bytes;
+	if (endptr == h_str || *endptr != '\0' || errno || w == 0 || h == 0 || pixel_data_size(w, h, &bytes)) return -1;
+	size->name = str;
+	size->w = w;
+	size->h = h;
+	return 0;
 }
 
-/*Create a new P6 file to save the filtered image in. Write the header block
- e.g. P6
-      Width Height
-      Max color value
- then write the image data.
- The name of the new file shall be "filename" (the second argument).
+/* Print the machine and build the bench results were taken on, so that results from different 
+ machines and commits can be told apart.
  */
-void write_image(PPMPixel *image, char *filename, unsigned long int width, unsigned long int height)
+void print_bench_header(int threads, long warmup, long reps)
 {
-	FILE* outfile;
-	outfile = fopen(filename, "w");
-	if (outfile == NULL) {
-		fprintf(stderr, "\"%s\": write file error: %s\n", filename, strerror(errno));
-		return;
+	char cpu[256] = "unknown";
+	FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+	if (cpuinfo) {
+		char line[512];
+		while (fgets(line, sizeof line, cpuinfo)) {
+			char *colon = strchr(line, ':');
+			if (strncmp(line, "model name", strlen("model name")) == 0 && colon) {
+				colon++;
+				while (isspace((unsigned char)*colon)) colon++;
+				line[strcspn(line, "\n")] = '\0';
+				snprintf(cpu, sizeof cpu, "%s", colon);
+				break;
+			}
+		}
+		fclose(cpuinfo);
 	}
-	
-	fprintf(outfile, "P6\n");
-	fprintf(outfile, "# Cameron Henderson Western Washington University CSCI347\n");
-	fprintf(outfile, "%lu ", width);
-	fprintf(outfile, "%lu\n", height);
-	fprintf(outfile, "%d\n", RGB_COMPONENT_COLOR);
+	printf("# rev: %s, compiler: %s, cpu: %s, online cpus: %ld\n", GIT_REV, __VERSION__, cpu, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("# band threads: %d, warmup: %ld, repetitions: %ld, bytes per pixel: %zu (read + write)\n",
+	       threads, warmup, reps, 2 * sizeof(PPMPixel));
+	printf("%-20s %-12s %-12s %12s %12s %10s %10s %12s\n", "size", "kernel", "variant", "median ms", "min ms", "MPix/s", "ns/pixel", "bytes/cycle");
+}
 
-	int pixels_written = 0;
-	for (int i = 0; i < width * height; i++) {
-		pixels_written += fwrite(&image[i], sizeof(PPMPixel), 1, outfile);
+#define BENCH_MAX_KERNELS 32    // kernels bench_main takes in --kernels
+
+/* Print the smallest kernel area from which the fft variant beat the engine on every kernel of the list that both 
+ ran on (engine_times and fft_times are the medians, 0 if the variant did not run), the value FFT_MIN_AREA is 
+ set from.
+ */
+void print_fft_crossover(const char *label, const struct kernel *kernels, const double *engine_times, 
+                         const double *fft_times, int num_kernels)
+{
+	int crossover = -1, compared = 0;
+	for (int i = 0; i < num_kernels; i++) {
+		if (!engine_times[i] || !fft_times[i]) continue;
+		compared = 1;
+		int area = kernels[i].w * kernels[i].h;
+		int faster = 1;
+		for (int j = 0; j < num_kernels; j++) {
+			if (engine_times[j] && fft_times[j] && kernels[j].w * kernels[j].h >= area && fft_times[j] >= engine_times[j]) faster = 0;
+		}
+		if (faster && (crossover < 0 || area < crossover)) crossover = area;
 	}
-	if (pixels_written < (width * height)) {
-		fprintf(stderr, "error writing to destination file \"%s\"\n", filename);
+	if (!compared) return;
+	if (crossover < 0) {
+		printf("# %s: fft slower than engine on every kernel (FFT_MIN_AREA %d)\n", label, FFT_MIN_AREA);
+	} else {
+		printf("# %s: fft faster than engine from kernel area %d (FFT_MIN_AREA %d)\n", label, crossover, FFT_MIN_AREA);
 	}
-	return;
 }
 
-/* Copy data from the stream into buffer 'buf' until whitespace is reached. 
- * A terminating null character is appended to the end of the characters in buf.
- * Any lines starting with # symbol will be skipped.
- * Return: number of characters written into buf, excluding the terminating null.
+/* The bench subcommand: bench [--sizes list] [--kernels list] [--variants list] [--warmup N] [--reps N] [--threads N]
+ Filter synthetic images in memory with each filter variant and print the median and minimum time,
+ the throughput (MPix/s and ns/pixel at the median) and the bytes moved per TSC cycle. 
+ No files are read or written, so only the filter itself is measured.
  */
-static int getnextchunk(FILE* file, char* buf, int bufsiz) {
-	char c = fgetc(file);
-	while ( c == '#' && c != EOF ) {
-		while ( c != '\n' && c != EOF ) { 
-			c = fgetc(file);
+int bench_main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{"sizes",    required_argument, NULL, 's'},
+		{"kernels",  required_argument, NULL, 'k'},
+		{"variants", required_argument, NULL, 'v'},
+		{"warmup",   required_argument, NULL, 'W'},
+		{"reps",     required_argument, NULL, 'n'},
+		{"threads",  required_argument, NULL, 't'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *sizes = "tiny,hd,8k";
+	const char *kernels = kernel_catalog[0].name;
+	const char *variants = NULL;
+	long warmup = 2, reps = 10, threads = LAPLACIAN_THREADS;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "s:k:v:W:n:t:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 's': sizes = optarg; break;
+		case 'k': kernels = optarg; break;
+		case 'v': variants = optarg; break;
+		case 'W': warmup = strcmp(optarg, "0") == 0 ? 0 : parse_count(optarg); break;
+		case 'n': reps = parse_count(optarg); break;
+		case 't': threads = parse_count(optarg); break;
+		default:
+			usage();
+			return EXIT_FAILURE;
 		}
-		if ( c != EOF) {
-			c = fgetc(file);
+	}
+	if (warmup < 0 || reps < 0 || threads < 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	// every failure from here on sets status and falls through to the cleanup at the end
+	int status = EXIT_SUCCESS;
+	struct kernel *bench_kernels = malloc(BENCH_MAX_KERNELS * sizeof(struct kernel));
+	char *kernel_list = strdup(kernels), *list = strdup(sizes), *saveptr;
+	double *times = malloc(reps * sizeof(double));
+	uint64_t *cycles = malloc(reps * sizeof(uint64_t));
+	if (!bench_kernels || !kernel_list || !list || !times || !cycles) {
+		perror("malloc");
+		status = EXIT_FAILURE;
+	}
+	// every variant unless a list was given
+	int selected[NUM_FILTER_VARIANTS];
+	int num_selected = 0;
+	if (variants && status == EXIT_SUCCESS) {
+		char *variant_list = strdup(variants);
+		for (char *name = variant_list ? strtok_r(variant_list, ",", &saveptr) : NULL; name; name = strtok_r(NULL, ",", &saveptr)) {
+			int variant = find_filter_variant(name);
+			if (variant < 0) {
+				fprintf(stderr, "unknown filter variant: %s\n", name);
+				status = EXIT_FAILURE;
+				break;
+			}
+			if (num_selected < NUM_FILTER_VARIANTS) selected[num_selected++] = variant;
 		}
+		free(variant_list);
+	} else {
+		for (int i = 0; i < NUM_FILTER_VARIANTS; i++) selected[num_selected++] = i;
 	}
-	if ( c == EOF) {
-		ungetc(c, file);
-		return 0; 
+	// catalog names, gauss-N or log-N; the names point in kernel_list
+	const char *kernel_names[BENCH_MAX_KERNELS];
+	double engine_times[BENCH_MAX_KERNELS], fft_times[BENCH_MAX_KERNELS];
+	int num_kernels = 0;
+	for (char *name = status == EXIT_SUCCESS ? strtok_r(kernel_list, ",", &saveptr) : NULL; name; 
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		if (num_kernels == BENCH_MAX_KERNELS) {
+			fprintf(stderr, "too many kernels, at most %d\n", BENCH_MAX_KERNELS);
+			status = EXIT_FAILURE;
+			break;
+		}
+		if (parse_kernel(name, &bench_kernels[num_kernels]) || strchr(name, ':')) {
+			fprintf(stderr, "unknown kernel: %s\n", name);
+			status = EXIT_FAILURE;
+			break;
+		}
+		kernel_names[num_kernels++] = name;
 	}
-	int i = 0; 
-	while ( !isspace(c) && c != EOF && i < bufsiz - 1) {
-		buf[i] = c;
-		c = fgetc(file);
-		i++;
+
+	struct job_options opts = default_options;
+	opts.threads = threads;
+	opts.inplace = 0;            // each repetition filters the same input
+	int pool_started = status == EXIT_SUCCESS && band_pool_start(&band_pool, opts.threads) == 0;
+	if (!pool_started) status = EXIT_FAILURE;
+	if (status == EXIT_SUCCESS) print_bench_header(opts.threads, warmup, reps);
+	for (char *name = status == EXIT_SUCCESS ? strtok_r(list, ",", &saveptr) : NULL; name && status == EXIT_SUCCESS; 
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		struct bench_size size;
+		if (parse_bench_size(name, &size)) {
+			fprintf(stderr, "invalid bench size: %s\n", name);
+			status = EXIT_FAILURE;
+			break;
+		}
+		struct image image;
+		if (make_synthetic_image(&image, size.w, size.h)) {
+			status = EXIT_FAILURE;
+			break;
+		}
+		unsigned long pixels = size.w * size.h;
+		char label[64];
+		snprintf(label, sizeof label, "%s (%lux%lu)", size.name, size.w, size.h);
+		for (int kernel = 0; kernel < num_kernels && status == EXIT_SUCCESS; kernel++) {
+			opts.kernel = bench_kernels[kernel];
+			int laplacian = kernel_equal(&opts.kernel, &laplacian8_kernel);
+			engine_times[kernel] = fft_times[kernel] = 0;
+			// every other kernel than the Laplacian runs the selected variants that apply to it (all of them when none 
+			// does), but passes only when it splits
+			struct kernel_passes passes;
+			int split = split_kernel(&opts.kernel, &passes) == 0;
+			int kernel_variants[NUM_FILTER_VARIANTS];
+			int num_variants = 0;
+			for (int pass = 0; pass < 2 && num_variants == 0; pass++) {
+				for (int v = 0; v < (pass ? NUM_FILTER_VARIANTS : num_selected); v++) {
+					int variant = pass ? v : selected[v];
+					if (!laplacian && (!filter_variants[variant].any_kernel || 
+					    (filter_variants[variant].band_fn == &compute_passes_threadfn && !split))) continue;
+					kernel_variants[num_variants++] = variant;
+				}
+			}
+			for (int v = 0; v < num_variants && status == EXIT_SUCCESS; v++) {
+				opts.variant = kernel_variants[v];
+				for (long i = 0; i < warmup + reps; i++) {
+					double elapsed;
+					uint64_t start_cycles = read_cycles();
+					struct image result;
+					int err = apply_filters(&image, &result, &opts, &elapsed);
+					uint64_t end_cycles = read_cycles();
+					if (err) {
+						status = EXIT_FAILURE;
+						break;
+					}
+					image_free(&result);
+					if (i >= warmup) {
+						times[i - warmup] = elapsed;
+						cycles[i - warmup] = end_cycles - start_cycles;
+					}
+				}
+				if (status != EXIT_SUCCESS) break;
+				qsort(times, reps, sizeof(double), compare_doubles);
+				double median = percentile(times, reps, 50);
+				double min_cycles = 0;
+				for (long i = 0; i < reps; i++) {
+					if (i == 0 || cycles[i] < min_cycles) min_cycles = cycles[i];
+				}
+				if (filter_variants[opts.variant].band_fn == &compute_convolution_threadfn) engine_times[kernel] = median;
+				if (filter_variants[opts.variant].band_fn == &compute_fft_threadfn) fft_times[kernel] = median;
+				printf("%-20s %-12s %-12s %12.3f %12.3f %10.1f %10.3f ", label, kernel_names[kernel], filter_variants[opts.variant].name,
+				       median * 1000, times[0] * 1000, pixels / median / 1e6, median * 1e9 / pixels);
+				if (min_cycles > 0) {
+					printf("%12.3f\n", 2 * sizeof(PPMPixel) * pixels / min_cycles);
+				} else {
+					printf("%12s\n", "n/a");
+				}
+				fflush(stdout);
+			}
+		}
+		if (status == EXIT_SUCCESS) print_fft_crossover(label, bench_kernels, engine_times, fft_times, num_kernels);
+		image_free(&image);
 	}
-	buf[i] = '\0';
-	while ( isspace(c)) {
-		c = fgetc(file);
-	}	
-	ungetc(c, file);
-	return i;
+	free(list);
+	free(kernel_list);
+	free(bench_kernels);
+	free(cycles);
+	free(times);
+	if (pool_started) band_pool_stop(&band_pool);
+	return status;
 }
 
+/* Summary statistics of a set of timings. */
+struct bench_stats {
+    double mean;
+    double median;
+    double stddev;               //sample standard deviation
+    double min;
+    double ci95;                 //half width of the 95% confidence interval of the mean
+};
+
+/* Return: the two-sided 95% Student t value for df degrees of freedom. */
+static double t_critical_95(long df)
+{
+	static const double t[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	                            2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	                            2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+	if (df < 1) return 0;
+	if (df <= 30) return t[df - 1];
+	if (df <= 60) return 2.000;
+	if (df <= 120) return 1.980;
+	return 1.960;
+}
 
-/* Open the filename image for reading, and parse it.
-    Example of a ppm header:    //http://netpbm.sourceforge.net/doc/ppm.html
-    P6                  -- image format
-    # comment           -- comment lines begin with
-    ## another comment  -- any number of comment lines
-    200 300             -- image width & height 
-    255                 -- max color value
- 
- Check if the image format is P6. If not, print invalid format error message.
- If there are comments in the file, skip them. You may assume that comments exist only in the header block.
- Read the image size information and store them in width and height.
- Check the rgb component, if not 255, display error message.
- Return: pointer to PPMPixel that has the pixel data of the input image (filename).The pixel data is stored in scanline
- order from left to right (up to bottom) in 3-byte chunks (r g b values for each pixel) encoded as binary numbers.
- On failure, return NULL (eg the filename does not exist, the header is not a valid P6 image header, 
- or there is an error while reading the file).
- The caller is responsible for freeing the return img pointer.
+/* Compute the statistics of the n timings in samples. samples is sorted in place. */
+void bench_statistics(double *samples, long n, struct bench_stats *stats)
+{
+	qsort(samples, n, sizeof(double), compare_doubles);
+	double sum = 0;
+	for (long i = 0; i < n; i++) sum += samples[i];
+	stats->mean = sum / n;
+	double squares = 0;
+	for (long i = 0; i < n; i++) squares += (samples[i] - stats->mean) * (samples[i] - stats->mean);
+	stats->stddev = n > 1 ? sqrt(squares / (n - 1)) : 0;
+	stats->median = percentile(samples, n, 50);
+	stats->min = samples[0];
+	stats->ci95 = n > 1 ? t_critical_95(n - 1) * stats->stddev / sqrt(n) : 0;
+}
+
+/* Open a results file for appending, as the experiment scripts do with >>.
+ Return: the file, or NULL on failure.
  */
-PPMPixel *read_image(const char *filename, unsigned long int *width, unsigned long int *height)
+static FILE *open_bench_csv(const char *path)
 {
-    PPMPixel *img;
-	FILE* infile;	
-	// open file for read-only
-	infile = fopen(filename, "r");
-	if (infile == NULL) {
-		fprintf(stderr, "\"%s\": image header read error: %s\n", filename, strerror(errno));
-		return NULL;
+	FILE *file = fopen(path, "a");
+	if (!file) {
+		fprintf(stderr, "\"%s\": bench results file error: %s\n", path, strerror(errno));
 	}
+	return file;
+}
 
-	char magic_num[32];
-	char width_str[32];
-	char height_str[32];
-	char maxcolor_str[32];
-	int rgb;
-	// get magic number
-	getnextchunk(infile, magic_num, 16);
-	if (strcmp(magic_num, "P6") != 0) {
-		fprintf(stderr, "\"%s\": image header read error: magic number does not match P6\n", filename);
-		return NULL;
-	}	
-	// get width
-	getnextchunk(infile, width_str, sizeof(width_str));
-	char* endptr;
-	errno = 0;
-	*width = strtol(width_str, &endptr, 10);
-	if (errno != 0) {
-		perror("strtol");
-		return NULL;
+/* The --bench N mode, which replaces experiment.sh and experimentfilesize.sh: the files are read once, then for each
+ band thread count in the sweep every image is filtered N times in this process (no recompiling, no process startup,
+ no page cache effects). One repetition of the sweep filters all the images, like one run of the program, and its 
+ time is the sum of the filter times, i.e. the "Total elapsed time" experiment.sh averages.
+ For each thread count the mean, median, standard deviation, minimum and 95% confidence interval are printed,
+ and the averages are appended to the --bench-csv file ("threads, count, nproc, avg", as experiment.sh writes)
+ and per file to the --bench-file-csv file ("threads, file, filesize, avg", as experimentfilesize.sh writes).
+ Return: 0 on success, -1 on failure.
+ */
+int bench_sweep(const struct pipeline_config *config, char *files[], int num_files)
+{
+	long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	long counts[64];
+	int num_counts = 0;
+	if (config->bench_threads) {
+		char *list = strdup(config->bench_threads), *saveptr;
+		for (char *str = strtok_r(list, ",", &saveptr); str; str = strtok_r(NULL, ",", &saveptr)) {
+			long n = parse_count(str);
+			if (n < 0 || n > INT32_MAX) {
+				fprintf(stderr, "\"%s\": expected a positive number\n", str);
+				free(list);
+				return -1;
+			}
+			if (num_counts < 64) counts[num_counts++] = n;
+		}
+		free(list);
+	} else {
+		// powers of two up to the number of CPUs, and the number of CPUs itself
+		for (long n = 1; n < nproc && num_counts < 63; n *= 2) counts[num_counts++] = n;
+		counts[num_counts++] = nproc > 0 ? nproc : 1;
 	}
-	if (endptr == width_str) {
-		fprintf(stderr, "\"%s\": image header read error: no digits found for width\n", filename);
-		return NULL;
+	long max_threads = 0;
+	for (int i = 0; i < num_counts; i++) {
+		if (counts[i] > max_threads) max_threads = counts[i];
 	}
-	// get height
-	getnextchunk(infile, height_str, sizeof(height_str));
-	errno = 0;
-	*height = strtol(height_str, &endptr, 10);
-	if (errno != 0) {
-		perror("strtol");
-		return NULL;
+
+	struct bench_input {
+		struct image image;
+		long long filesize;
+		double *times;           //filter time of each repetition
+	} *inputs = calloc(num_files, sizeof(struct bench_input));
+	double *totals = malloc(config->bench_reps * sizeof(double));
+	if (!inputs || !totals) {
+		perror("malloc");
+		return -1;
 	}
-	if (endptr == height_str) {
-		fprintf(stderr, "\"%s\": image header read error: no digits found for height\n", filename);
-		return NULL;
+	int status = 0;
+	const struct region *roi = default_options.has_roi ? &default_options.roi : NULL;
+	for (int i = 0; i < num_files && status == 0; i++) {
+		struct stat st;
+		inputs[i].filesize = stat(files[i], &st) == 0 ? st.st_size : -1;
+		int err = read_image(files[i], &inputs[i].image, roi, filter_halo(&default_options), default_options.border, NULL);
+		inputs[i].times = malloc(config->bench_reps * sizeof(double));
+		if (err || !inputs[i].times) {
+			fprintf(stderr, "\"%s\": input image read error\n", files[i]);
+			status = -1;
+		}
 	}
-	// get max color value
-	getnextchunk(infile, maxcolor_str, sizeof(maxcolor_str));
-	errno = 0;
-	rgb = strtol(maxcolor_str, &endptr, 10);
-	if (errno != 0) {
-		perror("strtol");
-		return NULL;
+	FILE *csv = NULL, *file_csv = NULL;
+	if (status == 0 && config->bench_csv && !(csv = open_bench_csv(config->bench_csv))) status = -1;
+	if (status == 0 && config->bench_file_csv && !(file_csv = open_bench_csv(config->bench_file_csv))) status = -1;
+	int pool_started = status == 0 && band_pool_start(&band_pool, max_threads) == 0;
+	if (!pool_started) status = -1;
+	if (status == 0) {
+		fprintf(report_out, "Bench: %d images, %ld repetitions, %ld online cpus\n", num_files, config->bench_reps, nproc);
+		fprintf(report_out, "%8s %10s %10s %10s %10s %18s\n", "threads", "mean", "median", "stddev", "min", "95% ci");
 	}
-	if (endptr == height_str) {
-		fprintf(stderr, "\"%s\": image header read error: no digits found for max rgb color value\n", filename);
-		return NULL;
-	}	
-	if (rgb != RGB_COMPONENT_COLOR) {
-		fprintf(stderr, "\"%s\": image header read error: maximum rgb color value must be %d\n", filename, RGB_COMPONENT_COLOR);
-		return NULL;
+	for (int c = 0; c < num_counts && status == 0; c++) {
+		struct job_options opts = default_options;
+		opts.threads = counts[c];
+		opts.inplace = 0;        // each repetition filters the same input
+		for (long r = 0; r < config->bench_reps && status == 0; r++) {
+			totals[r] = 0;
+			for (int i = 0; i < num_files; i++) {
+				struct image result;
+				if (apply_filters(&inputs[i].image, &result, &opts, &inputs[i].times[r])) {
+					status = -1;
+					break;
+				}
+				image_free(&result);
+				totals[r] += inputs[i].times[r];
+			}
+		}
+		if (status) break;
+		struct bench_stats stats;
+		bench_statistics(totals, config->bench_reps, &stats);
+		fprintf(report_out, "%8ld %10.4f %10.4f %10.4f %10.4f [%7.4f, %7.4f]\n", counts[c],
+		        stats.mean, stats.median, stats.stddev, stats.min, stats.mean - stats.ci95, stats.mean + stats.ci95);
+		// Number of threads, Num threads, Cores, Average Runtime (seconds)
+		if (csv) fprintf(csv, "%ld, %ld, %ld, %.4f\n", counts[c], config->bench_reps, nproc, stats.mean);
+		for (int i = 0; i < num_files && file_csv; i++) {
+			bench_statistics(inputs[i].times, config->bench_reps, &stats);
+			// Number of threads, file name, File size, Average Runtime (seconds)
+			fprintf(file_csv, "%ld, %s, %lld, %.4f\n", counts[c], files[i], inputs[i].filesize, stats.mean);
+		}
 	}
-	
-	int pixelarea = (*width) * (*height);
-	img = calloc( pixelarea, sizeof(PPMPixel));
-	if (!img) {
-		perror("malloc");
-		return NULL;
+	if (pool_started) band_pool_stop(&band_pool);
+	if (csv) fclose(csv);
+	if (file_csv) fclose(file_csv);
+	for (int i = 0; i < num_files; i++) {
+		image_free(&inputs[i].image);
+		free(inputs[i].times);
+	}
+	free(inputs);
+	free(totals);
+	return status;
+}
+
+/* Read the jobs in the manifest file, one "input output [key=value ...]" job per line, and hand each one to
+ fn(job, arg) as soon as it is parsed. Blank lines and lines starting with # are skipped, and a bad line is 
+ reported and skipped.
+ Return: 0 on success, -1 if the manifest could not be read.
+ */
+int for_each_manifest_job(const char *manifest, void (*fn)(struct image_job *job, void *arg), void *arg)
+{
+	FILE *file = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+	if (!file) {
+		fprintf(stderr, "\"%s\": manifest read error: %s\n", manifest, strerror(errno));
+		return -1;
 	}
-	int total_pixels_read = 0;
-	for (int i = 0; i < pixelarea; i++) {
-		int pixelread = fread(&img[i], sizeof(PPMPixel), 1, infile);
-		total_pixels_read += pixelread;
+	char *line = NULL;
+	size_t linesiz = 0;
+	unsigned long line_number = 0;
+	char err[256];
+	while (getline(&line, &linesiz, file) != -1) {
+		line_number++;
+		char *p = line;
+		while (isspace((unsigned char)*p)) p++;
+		if (*p == '\0' || *p == '#') continue;
+		struct image_job *job = parse_job_line(p, err, sizeof err);
+		if (!job) {
+			fprintf(stderr, "\"%s\" line %lu: %s\n", manifest, line_number, err);
+			continue;
+		}
+		fn(job, arg);
 	}
-	if (total_pixels_read < pixelarea && !feof(infile)) {
-		fprintf(stderr, "\"%s\": input image read error: expected pixels: %d, pixels read: %d\n", filename, pixelarea, total_pixels_read);
-		return NULL;
+	int status = 0;
+	if (ferror(file)) {
+		fprintf(stderr, "\"%s\": manifest read error: %s\n", manifest, strerror(errno));
+		status = -1;
 	}
-    return img;
+	free(line);
+	if (file != stdin) fclose(file);
+	return status;
 }
 
-/* The thread function that manages an image file. 
- Read an image file that is passed as an argument at runtime. 
- Apply the Laplacian filter. 
- Update the value of total_elapsed_time.
- Save the result image in a file called laplaciani.ppm, where i is the image file order in the passed arguments.
- Example: the result image of the file passed third during the input shall be called "laplacian3.ppm".
-*/
-void *manage_image_file(void *args) {
-	struct file_name_args* arguments = (struct file_name_args*) args;
-	unsigned long w;
-	unsigned long h;
-	double  elapsedTime = 0;
-	PPMPixel *input_img;
-	PPMPixel *output_img;
-	input_img = read_image(arguments->input_file_name, &w, &h); // must free after use
-	if (input_img) {
-		output_img = apply_filters(input_img, w, h, &elapsedTime); // must free after use
-		write_image(output_img, arguments->output_file_name, w, h); 	
-		printf("Input image: %s, Output image: %s, Elapsed time: %f\n", arguments->input_file_name, arguments->output_file_name, elapsedTime);
+static void push_read_job(struct image_job *job, void *arg)
+{
+	struct pipeline *pl = (struct pipeline*) arg;
+	job_queue_push(&pl->read_q, job);
+}
+
+/* Stream the jobs in the manifest file into the read queue.
+ Jobs are parsed only as the read queue makes room, so the pipeline starts working on the first job immediately.
+ Return: 0 on success, -1 if the manifest could not be read.
+ */
+int feed_manifest(struct pipeline *pl, const char *manifest)
+{
+	return for_each_manifest_job(manifest, &push_read_job, pl);
+}
+
+/* Buffer sizes collected by --dry-run */
+struct dry_run {
+    long long *inputs;           //bytes of the input buffer of each image
+    long long *results;          //bytes of the result and band parameters of each image
+    unsigned long count;
+    unsigned long capacity;
+    int failures;
+};
+
+/* Read the header of the input of job and print the buffers the job will need, then add them to dr. Frees job. */
+static void dry_run_job(struct image_job *job, void *arg)
+{
+	struct dry_run *dr = (struct dry_run*) arg;
+	const char *filename = job->names.input_file_name;
+	unsigned long w, h;
+	FILE *infile = fopen(filename, "r");
+	int err = !infile;
+	if (!infile) {
+		fprintf(stderr, "\"%s\": image header read error: %s\n", filename, strerror(errno));
+	} else {
+		err = read_header(infile, filename, &w, &h);
+		fclose(infile);
+	}
+	const struct region *roi = job->opts.has_roi ? &job->opts.roi : NULL;
+	if (!err && roi && (roi->w > w || roi->x > w - roi->w || roi->h > h || roi->y > h - roi->h)) {
+		fprintf(stderr, "\"%s\": region %lu,%lu,%lu,%lu is outside the %lux%lu image\n", filename, roi->x, roi->y, roi->w, roi->h, w, h);
+		err = 1;
+	}
+	if (!err && dr->count == dr->capacity) {
+		unsigned long capacity = dr->capacity ? 2 * dr->capacity : 64;
+		long long *inputs = realloc(dr->inputs, capacity * sizeof(long long));
+		if (inputs) dr->inputs = inputs;
+		long long *results = realloc(dr->results, capacity * sizeof(long long));
+		if (results) dr->results = results;
+		if (inputs && results) {
+			dr->capacity = capacity;
+		} else {
+			perror("malloc");
+			err = 1;
+		}
+	}
+	if (err) {
+		dr->failures++;
+		free_job(job);
+		return;
+	}
+	// the same buffers read_image and apply_filters allocate
+	unsigned long halo = filter_halo(&job->opts);
+	unsigned long in_w = (roi ? roi->w : w) + 2 * halo, in_h = (roi ? roi->h : h) + 2 * halo;
+	unsigned long out_w = roi ? roi->w : w, out_h = roi ? roi->h : h;
+	unsigned long bands = out_h < (unsigned long)job->opts.threads ? out_h : job->opts.threads;
+	int strips = fit_memory_cap(&job->opts, out_w, out_h);
+	long long input = (long long)in_h * row_stride(in_w);
+	long long result = bands * sizeof(struct parameter) + filter_scratch_bytes(&job->opts, bands);
+	result += filter_inplace(&job->opts) ? (long long)inplace_history_bytes(in_w, &job->opts.kernel, bands) : (long long)out_h * row_stride(out_w);
+	if (strips) {
+		// filter_strips keeps its strip buffers within the cap
+		input = memory_cap;
+		result = 0;
+		fprintf(report_out, "Input image: %s, %lux%lu, out of core, strip buffers %lld\n", filename, w, h, input);
 	} else {
-		fprintf(stderr, "\"%s\": input image read error, no output image created\n", arguments->input_file_name);
+		fprintf(report_out, "Input image: %s, %lux%lu, input buffer %lld, %s %lld, peak %lld\n",
+		        filename, w, h, input, filter_inplace(&job->opts) ? "in-place rows" : "result buffer", result, input + result);
+	}
+	dr->inputs[dr->count] = input;
+	dr->results[dr->count] = result;
+	dr->count++;
+	free_job(job);
+}
+
+static int compare_sizes_descending(const void *a, const void *b)
+{
+	long long x = *(const long long*)a;
+	long long y = *(const long long*)b;
+	return (x < y) - (x > y);
+}
+
+/* Return: the sum of the n largest of the count sizes, which are sorted in place. */
+static long long sum_largest(long long *sizes, unsigned long count, long n)
+{
+	qsort(sizes, count, sizeof(long long), compare_sizes_descending);
+	long long sum = 0;
+	for (unsigned long i = 0; i < count && i < (unsigned long)n; i++) sum += sizes[i];
+	return sum;
+}
+
+/* The --dry-run mode: read only the headers of the jobs' inputs, print the buffers each image needs, and predict
+ the peak memory of the run for the configured concurrency. An input buffer exists from its reader until its filter is
+ done, so at most readers + queue depth + filters of them are live; a result exists from its filter until its writer
+ is done, so at most filters + queue depth + writers of them are live. The prediction is the largest images filling all
+ of those slots, an upper bound of the image buffers (see mem_malloc).
+ Return: 0 on success, -1 if an input could not be used.
+ */
+int dry_run(const struct pipeline_config *config, char *files[], int num_files)
+{
+	struct dry_run dr = { NULL, NULL, 0, 0, 0 };
+	for (int i = 0; i < num_files; i++) {
+		struct image_job *job = new_job(files[i], "");
+		if (!job) {
+			perror("malloc");
+			return -1;
+		}
+		dry_run_job(job, &dr);
 	}
-	pthread_mutex_lock(&mtx_etime);
-	total_elapsed_time += elapsedTime;
-	pthread_mutex_unlock(&mtx_etime);
-	free(input_img);
-	free(output_img);
-	return NULL; //nothing to return?
+	int status = 0;
+	if (config->manifest && for_each_manifest_job(config->manifest, &dry_run_job, &dr)) {
+		status = -1;
+	}
+	long input_slots = config->readers + config->queue_depth + config->filters;
+	long result_slots = config->filters + config->queue_depth + config->writers;
+	long long peak = sum_largest(dr.inputs, dr.count, input_slots) + sum_largest(dr.results, dr.count, result_slots);
+	fprintf(report_out, "Predicted peak memory: %lld bytes of image buffers for %lu images "
+	        "(%ld readers, %ld filters, %ld writers, queue depth %ld)\n",
+	        peak, dr.count, config->readers, config->filters, config->writers, config->queue_depth);
+	free(dr.inputs);
+	free(dr.results);
+	return status || dr.failures ? -1 : 0;
 }
 
 /*The driver of the program. Check for the correct number of arguments. If wrong print the message: "Usage ./a.out filename[s]"
   It shall accept n filenames as arguments, separated by whitespace, e.g., ./a.out file1.ppm file2.ppm    file3.ppm
-  It will create a thread for each input file to manage.  
+  Each file is fed to the pipeline in argument order. Save the result image in a file called laplaciani.ppm, 
+  where i is the image file order in the passed arguments.
+  Example: the result image of the file passed third during the input shall be called "laplacian3.ppm".
   It will print the total elapsed time in .4 precision seconds(e.g., 0.1234 s). 
+  The serve, client, loadtest and bench subcommands are described in usage().
  */
 int main(int argc, char *argv[])
 {
-	printf("LAPLACIAN THREADS: %d\n", LAPLACIAN_THREADS);
-	if (argc < 2) {
-		fprintf(stderr, "Usage: ./edge_detector filenames[s]\n");
+	if (argc > 1 && strcmp(argv[1], "client") == 0) {
+		return client_main(argc - 1, argv + 1);
+	}
+	if (argc > 1 && strcmp(argv[1], "loadtest") == 0) {
+		return loadtest_main(argc - 1, argv + 1);
+	}
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		return bench_main(argc - 1, argv + 1);
+	}
+	int serving = argc > 1 && strcmp(argv[1], "serve") == 0;
+	struct pipeline_config config;
+	int first_arg = serving ? parse_pipeline_options(argc - 1, argv + 1, &config) + 1 : parse_pipeline_options(argc, argv, &config);
+	if (first_arg <= 0 || (serving && first_arg != argc - 1) || (!config.manifest && first_arg >= argc)) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	report_out = stdout;
+	if (metrics_format != METRICS_NONE && open_metrics(&config)) {
 		return EXIT_FAILURE;
 	}
+	if (config.bench_reps) {
+		if (config.manifest || serving) {
+			usage();
+			return EXIT_FAILURE;
+		}
+		return bench_sweep(&config, argv + first_arg, argc - first_arg) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if (config.dry_run) {
+		return dry_run(&config, argv + first_arg, argc - first_arg) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	fprintf(report_out, "LAPLACIAN THREADS: %d\n", default_options.threads);
+	if (cache_dir) {
+		char *dir_path;
+		if (asprintf(&dir_path, "%s/", cache_dir) < 0 || make_parent_dirs(dir_path)) {
+			return EXIT_FAILURE;
+		}
+		free(dir_path);
+	}
 	pthread_mutex_init(&mtx_etime, NULL);
-	int num_threads = argc - 1;
-	pthread_t threads[num_threads];
-	struct file_name_args* args = malloc(num_threads * sizeof(struct file_name_args));
-	if (!args) {
-		perror("malloc");
+	pthread_mutex_init(&mtx_cache, NULL);
+	pthread_mutex_init(&mtx_metrics, NULL);
+	if (serving) {
+		int status = serve(argv[first_arg], &config);
+		close_metrics();
+		pthread_mutex_destroy(&mtx_metrics);
+		pthread_mutex_destroy(&mtx_cache);
+		pthread_mutex_destroy(&mtx_etime);
+		return status ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	double start_time = now_seconds();
+	struct pipeline pl;
+	if (pipeline_start(&pl, config.readers, config.filters, config.writers, config.queue_depth)) {
 		return EXIT_FAILURE;
 	}
-	for (int i = 0; i < num_threads; i++) {
-		args[i].input_file_name = argv[i+1];
-		snprintf(args[i].output_file_name, sizeof args[i].output_file_name, "laplacian%d.ppm", i+1); 
-		pthread_create(&threads[i], NULL, &manage_image_file, (void*)&args[i]);
+	int status = EXIT_SUCCESS;
+	for (int i = first_arg; i < argc; i++) {
+		char output_file_name[32];
+		snprintf(output_file_name, sizeof output_file_name, default_options.threshold ? "laplacian%d.pbm" : "laplacian%d.ppm", 
+		         i - first_arg + 1); 
+		struct image_job *job = new_job(argv[i], output_file_name);
+		if (!job) {
+			perror("malloc");
+			status = EXIT_FAILURE;
+			break;
+		}
+		job_queue_push(&pl.read_q, job);
 	}
-	for (int i = 0; i < num_threads; i++) {
-		int err = pthread_join(threads[i], NULL);
-		if (err) 
-			fprintf(stderr, "pthread_join error: %s", strerror(err));
+	if (config.manifest && feed_manifest(&pl, config.manifest)) {
+		status = EXIT_FAILURE;
+	}
+	job_queue_close(&pl.read_q);
+	pipeline_finish(&pl);
+	if (failed_images) status = EXIT_FAILURE;   // the errors were reported as the jobs failed
+	print_summary(&config, now_seconds() - start_time);
+	pool_release();
+	if (config.trace_path && trace_write(config.trace_path)) {
+		status = EXIT_FAILURE;
 	}
-	printf("Total elapsed time: %.4f\n", total_elapsed_time);
-	free(args);
+	close_metrics();
+	pthread_mutex_destroy(&mtx_metrics);
+	pthread_mutex_destroy(&mtx_cache);
 	pthread_mutex_destroy(&mtx_etime);
-    return 0;
+    return status;
 }
-
@@ -1,22 +1,10 @@
 #! /bin/bash
 
 # $1= directory containing ppm files
-# $2 = number of laplacian threads
+# $2 = number of laplacian threads (or a comma separated list to sweep)
 # $3 = output file name for results
 
-total=0;
-count=0;
-avg=0;
-
-gcc -D LAPLACIAN_THREADS=$2 edge_detector.c -o edge_detector;
-for ((i=1; i<=50; i++)); do
-	((count++))
-	temp=$(./run_program.sh "$1")
-	total=$(echo "scale=4;$temp+$total" | bc)
-	echo "threads: $2, execution #$count"
-done
-
-avg=$(echo "scale=4;$total/$count"|bc)
-
+# The images are read once and filtered 50 times per thread count in one process
+# (see --bench in edge_detector.c). Appends one line per thread count:
 # Number of threads, Num threads, Cores, Average Runtime (seconds)
-echo "$2, $count, $(nproc), $avg" >> $3
+make -s edge_detector && ./edge_detector --bench 50 --bench-threads "$2" --bench-csv "$3" "$1"/*.ppm
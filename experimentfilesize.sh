@@ -1,25 +1,10 @@
 #! /bin/bash
 
 # $1= directory
-# $2 = number of laplacian threads
+# $2 = number of laplacian threads (or a comma separated list to sweep)
 # $3 = output file name for results
 
-
-gcc -D LAPLACIAN_THREADS=$2 edge_detector.c -o edge_detector;
-for FILE in $1/*.ppm; do
-		total=0;
-		count=0;
-		avg=0;
-
-		for ((i=1; i<=20; i++)); do
-			((count++))
-			temp=$(./edge_detector "$FILE")
-			total=$(echo "scale=4;$temp+$total" | bc)
-			echo "file: "$FILE" file size: $(wc -c < $FILE) threads: $2, execution #$count"
-		done
-
-		avg=$(echo "scale=4;$total/$count"|bc)
-
-		# Number of threads, file name, File size, Average Runtime (seconds)
-		echo "$2, "$FILE", $(wc -c < "$FILE"), $avg" >> $3
-done
+# Each file is read once and filtered 20 times per thread count in one process
+# (see --bench in edge_detector.c). Appends one line per thread count and file:
+# Number of threads, file name, File size, Average Runtime (seconds)
+make -s edge_detector && ./edge_detector --bench 20 --bench-threads "$2" --bench-file-csv "$3" "$1"/*.ppm
@@ -0,0 +1,202 @@
+/* Checks of edge_detector internals that the command line does not show. The program is compiled into this file, with
+ its main renamed, so that the checks can call its static functions. Build and run them with make check.
+ */
+#define main edge_detector_main
+#include "../edge_detector.c"
+#undef main
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+/* gauss-N is a column times a row, so it must split into one term and run in two passes */
+static void check_gauss_splits(void)
+{
+	for (int n = 3; n <= KERNEL_MAX_SIZE; n += 2) {
+		char name[16];
+		struct job_options opts = default_options;
+		struct kernel_passes passes;
+		snprintf(name, sizeof name, "gauss-%d", n);
+		CHECK(parse_kernel(name, &opts.kernel) == 0, "%s does not parse", name);
+		CHECK(split_kernel(&opts.kernel, &passes) == 0 && passes.terms == 1, "%s does not split into one term", name);
+		CHECK(select_band_fn(&opts, &passes) == &compute_passes_threadfn, "%s does not run in two passes", name);
+	}
+}
+
+/* Filter image with opts into result, over a copy of image with inplace=1.
+ Return: 0 on success, -1 on failure.
+ */
+static int filter_image(const struct image *image, const struct job_options *opts, struct image *result)
+{
+	struct image input;
+	double elapsed;
+	if (image_alloc(&input, image->w, image->h, 0)) return -1;
+	for (unsigned long y = 0; y < image->h; y++) memcpy(image_row(&input, y), image_row(image, y), image->w * sizeof(PPMPixel));
+	int status = apply_filters(&input, result, opts, &elapsed);
+	image_free(&input);
+	return status;
+}
+
+/* Every kernel of the catalog, and kernels of each path, through every variant, border mode and inplace=0|1, 
+ against the pixel by pixel reference convolve_edge_pixel. The divisors past INT16_MAX must stay out of the int16_t 
+ lanes of convolve_row.
+ */
+static void check_kernels_against_reference(void)
+{
+	static const char *const extra_kernels[] = { "gauss-7", "log-13", "3x3:-1,-1,-1,-1,-1,-1,-1,-1,-1/65535",
+	                                              "3x3:1,1,1,1,1,1,1,1,1/-40000", "5x5:0,0,-1,0,0,0,-1,-2,-1,0,-1,-2,16,-2,-1,0,-1,-2,-1,0,0,0,-1,0,0/-3" };
+	const char *names[NUM_CATALOG_KERNELS + sizeof extra_kernels / sizeof extra_kernels[0]];
+	int num_kernels = 0;
+	for (int i = 0; i < NUM_CATALOG_KERNELS; i++) names[num_kernels++] = kernel_catalog[i].name;
+	for (size_t i = 0; i < sizeof extra_kernels / sizeof extra_kernels[0]; i++) names[num_kernels++] = extra_kernels[i];
+	struct image image;
+	if (make_synthetic_image(&image, 45, 19) || band_pool_start(&band_pool, 3)) {
+		failures++;
+		return;
+	}
+	for (int i = 0; i < num_kernels; i++) {
+		struct job_options opts = default_options;
+		opts.threads = 3;
+		if (parse_kernel(names[i], &opts.kernel)) {
+			CHECK(0, "%s does not parse", names[i]);
+			continue;
+		}
+		const struct kernel *k = &opts.kernel;
+		for (opts.variant = 0; opts.variant < NUM_FILTER_VARIANTS; opts.variant++) {
+			for (opts.border = 0; opts.border < NUM_BORDER_MODES; opts.border++) {
+				for (opts.inplace = 0; opts.inplace < 2; opts.inplace++) {
+					struct image result;
+					if (filter_image(&image, &opts, &result)) {
+						CHECK(0, "%s %s failed", names[i], filter_variants[opts.variant].name);
+						continue;
+					}
+					int bad = 0;
+					for (unsigned long y = 0; y < image.h && !bad; y++) {
+						const PPMPixel *rows[KERNEL_MAX_SIZE];
+						for (int ky = 0; ky < k->h; ky++) {
+							long ny = border_coordinate(opts.border, (long)y - k->h / 2 + ky, image.h);
+							rows[ky] = ny < 0 ? NULL : image_row(&image, ny);
+						}
+						for (unsigned long x = 0; x < image.w && !bad; x++) {
+							PPMPixel ref, px = image_row(&result, y)[x];
+							convolve_edge_pixel(k, opts.border, rows, image.w, x, &ref);
+							bad = px.r != ref.r || px.g != ref.g || px.b != ref.b;
+							CHECK(!bad, "%s variant=%s border=%s inplace=%d: pixel %lu,%lu is %d,%d,%d instead of %d,%d,%d", 
+							      names[i], filter_variants[opts.variant].name, border_mode_names[opts.border], opts.inplace,
+							      x, y, px.r, px.g, px.b, ref.r, ref.g, ref.b);
+						}
+					}
+					image_free(&result);
+				}
+			}
+		}
+	}
+	band_pool_stop(&band_pool);
+	image_free(&image);
+}
+
+/* Create an empty temporary file for a check, and unlink it right away so that it goes when fd is closed.
+ Return: its descriptor, or -1 on failure.
+ */
+static int temp_file(void)
+{
+	char path[] = "/tmp/edge_detector_test.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	unlink(path);
+	return fd;
+}
+
+/* The size paths of a 60000x60000 image, 10.8 GB of pixel data past 2^32, without the memory or the disk: the file is
+ a header followed by a hole (ftruncate), and the pixels of its last rows are written and read back at their offset.
+ */
+static void check_sparse_image(void)
+{
+	const unsigned long side = 60000;
+	const char header[] = "P6\n# sparse\n60000 60000\n255\n";
+	size_t bytes;
+	CHECK(pixel_data_size(side, side, &bytes) == 0 && bytes == 10800000000ULL, "60000x60000 has %zu bytes", bytes);
+	CHECK(pixel_data_size(1UL << 32, 1UL << 32, &bytes) == -1, "2^32 x 2^32 is not rejected");
+	int fd = temp_file();
+	if (fd < 0) {
+		failures++;
+		return;
+	}
+	off_t data = sizeof header - 1;
+	if (write(fd, header, data) != data || ftruncate(fd, data + bytes)) {
+		perror("sparse file");
+		failures++;
+		close(fd);
+		return;
+	}
+	// the bottom right 4x2 pixels, written by write_rows at an offset past 2^33
+	struct image corner;
+	if (image_alloc(&corner, 4, 2, 1)) {
+		failures++;
+		close(fd);
+		return;
+	}
+	for (unsigned long y = 0; y < corner.h; y++) {
+		for (unsigned long x = 0; x < corner.w; x++) image_row(&corner, y)[x] = (PPMPixel){ 1 + x, 2 + y, 3 };
+	}
+	off_t last_rows = data + (off_t)(side - corner.h) * side * sizeof(PPMPixel);
+	for (unsigned long y = 0; y < corner.h; y++) {
+		struct image row = corner;
+		row.pixels = image_row(&corner, y);
+		row.h = 1;
+		off_t offset = last_rows + (off_t)y * side * sizeof(PPMPixel) + (side - corner.w) * sizeof(PPMPixel);
+		CHECK(write_rows(fd, offset, &row) == 0, "write_rows at %lld failed", (long long)offset);
+	}
+	struct stat st;
+	CHECK(fstat(fd, &st) == 0 && st.st_size == data + (off_t)bytes, "the writes changed the file size");
+
+	lseek(fd, 0, SEEK_SET);
+	FILE *infile = fdopen(dup(fd), "r");
+	unsigned long w = 0, h = 0;
+	CHECK(infile && read_header(infile, "sparse", &w, &h) == 0 && w == side && h == side, "header read as %lux%lu", w, h);
+	// a region of the last rows, read with pread from past 2^33
+	struct region roi = { side - corner.w, side - corner.h, corner.w, corner.h };
+	struct image img = {0};
+	CHECK(infile && fseeko(infile, 0, SEEK_SET) == 0 && read_image_stream(infile, "sparse", &img, &roi, 0, BORDER_WRAP, NULL) == 0,
+	      "reading the corner failed");
+	if (img.pixels) {
+		for (unsigned long y = 0; y < corner.h; y++) {
+			CHECK(memcmp(image_row(&img, y), image_row(&corner, y), corner.w * sizeof(PPMPixel)) == 0, "corner row %lu differs", y);
+		}
+		image_free(&img);
+	}
+	if (infile) fclose(infile);
+
+	// one byte short of the pixel data
+	CHECK(ftruncate(fd, data + bytes - 1) == 0, "ftruncate");
+	lseek(fd, 0, SEEK_SET);
+	infile = fdopen(dup(fd), "r");
+	fprintf(stderr, "(expected) ");
+	CHECK(infile && read_header(infile, "truncated", &w, &h) == -1, "a truncated file passes read_header");
+	if (infile) fclose(infile);
+	image_free(&corner);
+	close(fd);
+}
+
+int main(void)
+{
+	check_gauss_splits();
+	check_kernels_against_reference();
+	check_sparse_image();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("all checks passed\n");
+	return EXIT_SUCCESS;
+}